@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdexcept>
+#include <system_error>
+#include <wq.hpp>
+
+/* continues on a worker, then returns to whoever awaits it. */
+static wq::task<int>
+square(wq::workqueue &q, int n)
+{
+    co_await q.schedule();
+    co_return n * n;
+}
+
+/* awaits nested tasks, each of which hops onto a worker. */
+static wq::task<int>
+sum_of_squares(wq::workqueue &q, int n)
+{
+    int sum = 0;
+
+    for (int i = 1; i <= n; i++) {
+        sum += co_await square(q, i);
+    }
+    co_return sum;
+}
+
+static wq::task<>
+fail(wq::workqueue &q)
+{
+    co_await q.schedule();
+    throw std::runtime_error("oops");
+}
+
+int
+main(int argc, char **argv)
+{
+    wq::workqueue q;
+
+    printf("sum of squares: %d\n", wq::sync_wait(sum_of_squares(q, 10)));
+
+    try {
+        wq::sync_wait(fail(q));
+    } catch (const std::exception &ex) {
+        printf("caught: %s\n", ex.what());
+    }
+
+    wq::task<int> t = square(q, 2);
+    wq::task<int> u = std::move(t);
+    try {
+        wq::sync_wait(std::move(t));
+    } catch (const std::system_error &ex) {
+        printf("caught: %s\n", ex.what());
+    }
+    printf("moved: %d\n", wq::sync_wait(std::move(u)));
+    return 0;
+}
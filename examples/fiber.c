@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <wq.h>
+
+#ifdef __WIN32
+#error "Fiber backend not yet implemented for WIN32."
+#endif
+
+/* Tasks on the "fiber" backend parking and resuming.  Each task yields
+   a few times, possibly continuing on another worker every time, and
+   checks that its stack and the descriptor it was submitted with
+   survived.  The tasks of the second round park waiting for a nested
+   workqueue_parallel_reduce().  There are many more tasks than workers
+   and the stacks are small, so stacks get reused through the cache. */
+#define TASKS 10000
+#define NESTED 200
+#define YIELDS 4
+
+static workqueue_t wq;
+static int bad;
+static int moved;
+
+static void
+check(int ok)
+{
+    if (!ok) {
+        __atomic_add_fetch(&bad, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+yielder(int id, void *arg)
+{
+    int n = *(int *)arg, fd = workqueue_item_fd(), i;
+    int self = workqueue_self(&wq);
+    char buf[256];
+
+    memset(buf, n, sizeof(buf));
+    for (i = 0; i < YIELDS; i++) {
+        workqueue_yield();
+        if (workqueue_self(&wq) != self) {
+            __atomic_add_fetch(&moved, 1, __ATOMIC_RELAXED);
+            self = workqueue_self(&wq);
+        }
+    }
+    for (i = 0; i < sizeof(buf); i++) {
+        check(buf[i] == (char)n);
+    }
+    check(workqueue_item_fd() == fd && fcntl(fd, F_GETFD) >= 0);
+}
+
+static void
+sum(void *ctx, long b, long e, void *acc)
+{
+    for (; b < e; b++) {
+        *(long *)acc += b;
+    }
+}
+
+static void
+combine(void *ctx, void *result, const void *acc)
+{
+    *(long *)result += *(const long *)acc;
+}
+
+static void
+nested(int id, void *arg)
+{
+    long result = 1, zero = 0;
+
+    workqueue_parallel_reduce(&wq, 0, 100, 50, sum, combine, NULL,
+                              &result, &zero, sizeof(result));
+    check(result == 4951);
+}
+
+static void
+wait_idle(void)
+{
+    workqueue_lock(&wq);
+    while (!workqueue_idle(&wq)) {
+        workqueue_wait(&wq, 0);
+    }
+    workqueue_unlock(&wq);
+}
+
+int
+main(int argc, char **argv)
+{
+    int rc, fd, i;
+
+    rc = workqueue_init(&wq, "fiber");
+    if (rc < 0) {
+        perror("workqueue_init");
+        return 1;
+    }
+    wq.max_workers = 4;
+    wq.stack_size = 16 * 1024;
+
+    fd = open("/dev/null", O_RDONLY);
+    for (i = 0; i < TASKS; i++) {
+        rc = workqueue_submit_fd(&wq, yielder, &i, sizeof(i), fd);
+        check(rc == 0);
+    }
+    wait_idle();
+    close(fd);
+
+    for (i = 0; i < NESTED; i++) {
+        rc = workqueue_submit(&wq, nested, NULL);
+        check(rc == 0);
+    }
+    wait_idle();
+
+    workqueue_destroy(&wq);
+    printf("%d tasks, %d resumed on another worker, %d failed checks\n",
+           TASKS + NESTED, moved, bad);
+    return (bad == 0) ? 0 : 1;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <wq.h>
+
+/* Task graphs.  A random DAG is run a few times: every node must run
+   exactly once per run and only after all of its dependencies have
+   finished.  Then a node fails in a small graph: the nodes that depend
+   on it, directly or not, must be skipped while the others still run,
+   and workqueue_graph_wait() must return its error.  Finally a cycle
+   must be refused with EDEADLK.  The backend ("thread" by default) may
+   be given on the command line. */
+#define NODES 500
+#define DEPS 3
+#define RUNS 3
+
+typedef struct node {
+    workqueue_node_t *node;
+    struct node *deps[DEPS];
+    unsigned int ndeps;
+    unsigned int runs;
+    int result;
+} node_t;
+
+static node_t nodes[NODES];
+static unsigned int bad;
+
+static int
+run(int id, void *arg)
+{
+    node_t *n = arg;
+    unsigned int i, runs = __atomic_load_n(&n->runs, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < n->ndeps; i++) {
+        if (__atomic_load_n(&n->deps[i]->runs, __ATOMIC_ACQUIRE) !=
+            runs + 1) {
+            __atomic_add_fetch(&bad, 1, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_add_fetch(&n->runs, 1, __ATOMIC_RELEASE);
+    return n->result;
+}
+
+static void
+check(int ok, const char *what)
+{
+    if (!ok) {
+        printf("failed: %s\n", what);
+        bad++;
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *backend = (argc > 1) ? argv[1] : "thread";
+    workqueue_graph_t *g;
+    workqueue_t wq;
+    unsigned int i, j, r;
+    int rc;
+
+    rc = workqueue_init(&wq, backend);
+    if (rc < 0) {
+        perror("workqueue_init");
+        return 1;
+    }
+    wq.max_workers = 4;
+
+    /* each node depends on up to DEPS earlier ones. */
+    g = workqueue_graph_create(&wq);
+    srand(1);
+    for (i = 0; i < NODES; i++) {
+        nodes[i].node = workqueue_graph_add(g, run, &nodes[i]);
+        for (j = 0; i > 0 && j < DEPS; j++) {
+            node_t *dep = &nodes[rand() % i];
+            unsigned int k;
+
+            for (k = 0; k < nodes[i].ndeps && nodes[i].deps[k] != dep; k++)
+                ;
+            if (k == nodes[i].ndeps) {
+                nodes[i].deps[nodes[i].ndeps++] = dep;
+                workqueue_graph_depend(g, nodes[i].node, dep->node);
+            }
+        }
+    }
+    for (r = 0; r < RUNS; r++) {
+        check(workqueue_graph_run(g) == 0, "run");
+        check(workqueue_graph_wait(g) == 0, "wait");
+        for (i = 0; i < NODES; i++) {
+            if (nodes[i].runs != r + 1) {
+                printf("node %u ran %u times in %u runs\n",
+                       i, nodes[i].runs, r + 1);
+                bad++;
+            }
+        }
+    }
+    workqueue_graph_destroy(g);
+
+    /* 0 -> 1 -> 2 -> 3, 1 -> 4, 0 -> 5 and 6 on its own; 1 fails. */
+    memset(nodes, 0, sizeof(nodes));
+    g = workqueue_graph_create(&wq);
+    for (i = 0; i < 7; i++) {
+        nodes[i].node = workqueue_graph_add(g, run, &nodes[i]);
+    }
+    nodes[1].result = EIO;
+    workqueue_graph_depend(g, nodes[1].node, nodes[0].node);
+    workqueue_graph_depend(g, nodes[2].node, nodes[1].node);
+    workqueue_graph_depend(g, nodes[3].node, nodes[2].node);
+    workqueue_graph_depend(g, nodes[4].node, nodes[1].node);
+    workqueue_graph_depend(g, nodes[5].node, nodes[0].node);
+    check(workqueue_graph_run(g) == 0, "run");
+    check(workqueue_graph_wait(g) == EIO, "wait returns the error");
+    check(nodes[0].runs == 1 && nodes[1].runs == 1, "failing node ran");
+    check(nodes[2].runs == 0 && nodes[3].runs == 0 && nodes[4].runs == 0,
+          "successors of the failed node skipped");
+    check(nodes[5].runs == 1 && nodes[6].runs == 1,
+          "unrelated nodes ran");
+
+    /* 3 -> 0 closes a cycle. */
+    workqueue_graph_depend(g, nodes[0].node, nodes[3].node);
+    rc = workqueue_graph_run(g);
+    check(rc < 0 && errno == EDEADLK, "cycle refused");
+    workqueue_graph_destroy(g);
+
+    workqueue_destroy(&wq);
+    printf("%s: %u failed checks\n", backend, bad);
+    return (bad == 0) ? 0 : 1;
+}
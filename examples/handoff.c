@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <wq.h>
+
+#ifdef __WIN32
+#error "Process backend not yet implemented for WIN32."
+#endif
+
+/* Stresses the ways an item gets to a worker: rounds alternate between
+   a single item submitted while every worker is parked, which is handed
+   straight to one of them, and a burst that goes through the pipe.
+   Every item must run exactly once.  The backend ("thread" by default)
+   may be given on the command line; build with -fsanitize=thread to
+   check these paths for races. */
+#define ROUNDS 400
+#define BURST 256
+
+static unsigned int *runs;
+
+static void
+count(int id, void *arg)
+{
+    __atomic_add_fetch(&runs[(long)arg], 1, __ATOMIC_RELAXED);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *backend = (argc > 1) ? argv[1] : "thread";
+    long n = 0, i, r, bad = 0;
+    workqueue_t wq;
+    int rc;
+
+    /* shared, so "process" workers count where we can see it. */
+    runs = mmap(NULL, ROUNDS * BURST * sizeof(*runs),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (runs == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    rc = workqueue_init(&wq, backend);
+    if (rc < 0) {
+        perror("workqueue_init");
+        return 1;
+    }
+    wq.max_workers = 4;
+
+    for (r = 0; r < ROUNDS; r++) {
+        long k = (r % 2 == 0) ? 1 : BURST;
+
+        for (i = 0; i < k; i++) {
+            if (workqueue_submit(&wq, count, (void *)n) == 0) {
+                n++;
+            }
+        }
+        workqueue_lock(&wq);
+        while (!workqueue_idle(&wq)) {
+            workqueue_wait(&wq, 0);
+        }
+        workqueue_unlock(&wq);
+    }
+    workqueue_destroy(&wq);
+
+    for (i = 0; i < n; i++) {
+        if (runs[i] != 1) {
+            bad++;
+        }
+    }
+    printf("%s: %ld items, %ld not run exactly once\n", backend, n, bad);
+    return (bad == 0) ? 0 : 1;
+}
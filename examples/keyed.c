@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wq.h>
+
+/* Keyed submission.  In the first phase every key gets one item per
+   round, too few to make any lane hot (beyond 32 queued items a lane
+   spills over to a second one, whatever its keys): a key's items must
+   then never overlap and must run in the order they were submitted.  In the second
+   phase a single key gets a burst, which may spill over to a second
+   lane: every item must still run, and never more than two at a time.
+   How often a key changed workers is reported; with the "thread" and
+   "fiber" backends, whose lanes belong to a worker, it should be rare.  Needs a shared-memory
+   backend ("thread" by default, may be given on the command line). */
+#define KEYS 32
+#define ROUNDS 400
+#define PER_ROUND 1
+#define BURST 20000
+#define MAX_WORKERS 4
+
+typedef struct keystate {
+    int inside;
+    unsigned int next;
+    unsigned int overlaps;
+    unsigned int misordered;
+    int last;
+    unsigned int moves;
+} keystate_t;
+
+typedef struct item {
+    keystate_t *key;
+    unsigned int seq;
+} item_t;
+
+static workqueue_t wq;
+static keystate_t keys[KEYS + 1];
+static item_t items[KEYS][ROUNDS * PER_ROUND];
+static int running, peak;
+static unsigned int burst_runs;
+
+static void
+run(int id, void *arg)
+{
+    item_t *item = arg;
+    keystate_t *k = item->key;
+    int self = workqueue_self(&wq);
+
+    if (__atomic_exchange_n(&k->inside, 1, __ATOMIC_ACQUIRE) != 0) {
+        __atomic_add_fetch(&k->overlaps, 1, __ATOMIC_RELAXED);
+    }
+    if (k->next != item->seq) {
+        k->misordered++;
+    }
+    k->next = item->seq + 1;
+    if (k->last != self) {
+        k->moves++;
+        k->last = self;
+    }
+    __atomic_store_n(&k->inside, 0, __ATOMIC_RELEASE);
+}
+
+static void
+hot(int id, void *arg)
+{
+    int n = __atomic_add_fetch(&running, 1, __ATOMIC_ACQ_REL), p;
+
+    p = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+    while (n > p && !__atomic_compare_exchange_n(&peak, &p, n, false,
+                                                 __ATOMIC_RELAXED,
+                                                 __ATOMIC_RELAXED))
+        ;
+    __atomic_add_fetch(&burst_runs, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&running, 1, __ATOMIC_ACQ_REL);
+}
+
+static void
+wait_idle(void)
+{
+    workqueue_lock(&wq);
+    while (!workqueue_idle(&wq)) {
+        workqueue_wait(&wq, 0);
+    }
+    workqueue_unlock(&wq);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *backend = (argc > 1) ? argv[1] : "thread";
+    unsigned int r, i, k, moves = 0, bad = 0;
+    int rc;
+
+    rc = workqueue_init(&wq, backend);
+    if (rc < 0) {
+        perror("workqueue_init");
+        return 1;
+    }
+    wq.max_workers = MAX_WORKERS;
+
+    for (k = 0; k < KEYS; k++) {
+        keys[k].last = -1;
+    }
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < PER_ROUND; i++) {
+            for (k = 0; k < KEYS; k++) {
+                item_t *item = &items[k][r * PER_ROUND + i];
+
+                item->key = &keys[k];
+                item->seq = r * PER_ROUND + i;
+                rc = workqueue_submit_keyed(&wq, k, run, item);
+                if (rc < 0) {
+                    perror("workqueue_submit_keyed");
+                    return 1;
+                }
+            }
+        }
+        wait_idle();
+    }
+
+    for (k = 0; k < KEYS; k++) {
+        if (keys[k].next != ROUNDS * PER_ROUND || keys[k].overlaps > 0 ||
+            keys[k].misordered > 0) {
+            printf("key %u: %u of %u ran, %u overlapping, "
+                   "%u out of order\n", k, keys[k].next,
+                   ROUNDS * PER_ROUND, keys[k].overlaps,
+                   keys[k].misordered);
+            bad++;
+        }
+        /* the first run is not a move. */
+        moves += keys[k].moves - 1;
+    }
+
+    for (i = 0; i < BURST; i++) {
+        if (workqueue_submit_keyed(&wq, KEYS, hot, NULL) < 0) {
+            perror("workqueue_submit_keyed");
+            return 1;
+        }
+    }
+    wait_idle();
+    if (burst_runs != BURST || peak > 2) {
+        printf("hot key: %u of %u ran, up to %d at a time\n",
+               burst_runs, BURST, peak);
+        bad++;
+    }
+
+    workqueue_destroy(&wq);
+    printf("%s: %.2f worker changes per key, %u failed checks\n",
+           backend, (double)moves / KEYS, bad);
+    return (bad == 0) ? 0 : 1;
+}
@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <memory>
+#include <stdexcept>
+#include <wq.hpp>
+
+int
+main(int argc, char **argv)
+{
+    wq::workqueue q;
+
+    /* small and trivially copyable: travels inside the work item. */
+    int n = 1;
+    q.post([n] { printf("Hello World! (%d)\n", n); });
+
+    /* move-only capture: stored in a pooled node. */
+    std::unique_ptr<int> p(new int(2));
+    q.post([p = std::move(p)] { printf("Hello World! (%d)\n", *p); });
+
+    wq::future<int> f = q.submit([] { return 6 * 7; });
+    printf("answer: %d\n", f.get());
+
+    wq::future<void> e = q.submit([] { throw std::runtime_error("oops"); });
+    try {
+        e.get();
+    } catch (const std::exception &ex) {
+        printf("caught: %s\n", ex.what());
+    }
+
+    q.wait();
+    return 0;
+}
@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <wq.h>
+
+/* Low-memory settings.  Many "nofd" queues are created, with small
+   worker stacks and, for every other one, no guard page: the queues
+   must not use a single file descriptor, their items must all run, and
+   (with glibc, which can tell) the workers must have the stack and
+   guard sizes asked for. */
+#define QUEUES 200
+#define ITEMS 20
+#define STACK (64 * 1024)
+
+static workqueue_t queues[QUEUES];
+static unsigned int runs[QUEUES];
+static unsigned int bad;
+
+static unsigned int
+open_fds(void)
+{
+    unsigned int n = 0;
+    int fd;
+
+    for (fd = 0; fd < 1024; fd++) {
+        if (fcntl(fd, F_GETFD) >= 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
+static void
+run(int id, void *arg)
+{
+    unsigned long q = (unsigned long)arg;
+    /* well within a small stack. */
+    char buf[STACK / 4];
+
+    memset(buf, (int)q, sizeof(buf));
+    if (buf[sizeof(buf) - 1] != (char)q) {
+        __atomic_add_fetch(&bad, 1, __ATOMIC_RELAXED);
+    }
+#ifdef __GLIBC__
+    {
+        pthread_attr_t attr;
+        size_t stack = 0, guard = 0;
+
+        pthread_getattr_np(pthread_self(), &attr);
+        pthread_attr_getstacksize(&attr, &stack);
+        pthread_attr_getguardsize(&attr, &guard);
+        pthread_attr_destroy(&attr);
+        if (stack != STACK || (guard == 0) != (q % 2 == 1)) {
+            printf("queue %lu: stack %zu, guard %zu\n", q, stack, guard);
+            __atomic_add_fetch(&bad, 1, __ATOMIC_RELAXED);
+        }
+    }
+#endif
+    __atomic_add_fetch(&runs[q], 1, __ATOMIC_RELAXED);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned int fds = open_fds(), i;
+    unsigned long q;
+
+    for (q = 0; q < QUEUES; q++) {
+        if (workqueue_init(&queues[q], "nofd") < 0) {
+            perror("workqueue_init");
+            return 1;
+        }
+        queues[q].max_workers = 2;
+        queues[q].stack_size = STACK;
+        if (q % 2 == 1) {
+            queues[q].guard_size = WORKQUEUE_GUARD_NONE;
+        }
+    }
+    if (open_fds() != fds) {
+        printf("%u descriptors opened by %d queues\n",
+               open_fds() - fds, QUEUES);
+        bad++;
+    }
+
+    for (i = 0; i < ITEMS; i++) {
+        for (q = 0; q < QUEUES; q++) {
+            if (workqueue_submit(&queues[q], run, (void *)q) < 0) {
+                perror("workqueue_submit");
+                return 1;
+            }
+        }
+    }
+    for (q = 0; q < QUEUES; q++) {
+        workqueue_lock(&queues[q]);
+        while (!workqueue_idle(&queues[q])) {
+            workqueue_wait(&queues[q], 0);
+        }
+        workqueue_unlock(&queues[q]);
+        if (runs[q] != ITEMS) {
+            printf("queue %lu: %u of %u items ran\n", q, runs[q], ITEMS);
+            bad++;
+        }
+        workqueue_destroy(&queues[q]);
+    }
+    if (open_fds() != fds) {
+        printf("%u descriptors left open\n", open_fds() - fds);
+        bad++;
+    }
+
+    printf("%d queues, %u failed checks\n", QUEUES, bad);
+    return (bad == 0) ? 0 : 1;
+}
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <wq.h>
+
+#ifdef __WIN32
+#error "Named queues not yet implemented for WIN32."
+#endif
+
+/* A named queue fed by other processes.  Forked producers open the
+   queue by name and submit numbered items through a small ring, which
+   fills up often; every item must reach the creator's queue exactly
+   once.  Then a producer dies in the middle of a submit, its data
+   faulting while being copied into a slot it has claimed: the creator
+   must give that slot up and keep going, and count the item as lost.
+   The backend ("thread" by default) may be given on the command line,
+   but not "process" or "hybrid": they reap every child of the process,
+   so the producers' exit statuses would be lost. */
+#define PRODUCERS 4
+#define ITEMS 5000
+#define SLOTS 16
+
+typedef struct item {
+    unsigned int producer;
+    unsigned int seq;
+} item_t;
+
+static unsigned int runs[PRODUCERS + 1][ITEMS];
+
+static void
+run(int id, void *arg)
+{
+    item_t *item = arg;
+
+    if (item->producer <= PRODUCERS && item->seq < ITEMS) {
+        __atomic_add_fetch(&runs[item->producer][item->seq], 1,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+/* in a child: 0 once all its items are in. */
+static int
+produce(const char *name, unsigned int producer)
+{
+    workqueue_named_t *q = workqueue_named_open(name);
+    item_t item;
+
+    if (q == NULL) {
+        perror("workqueue_named_open");
+        return 1;
+    }
+    item.producer = producer;
+    for (item.seq = 0; item.seq < ITEMS; item.seq++) {
+        while (workqueue_named_submit(q, &item, sizeof(item)) < 0) {
+            if (errno != EAGAIN) {
+                perror("workqueue_named_submit");
+                return 1;
+            }
+            usleep(100);
+        }
+    }
+    workqueue_named_close(q);
+    return 0;
+}
+
+/* in a child: dies inside workqueue_named_submit(). */
+static void
+die(const char *name)
+{
+    workqueue_named_t *q = workqueue_named_open(name);
+    struct rlimit rl = { 0, 0 };
+    void *data;
+
+    setrlimit(RLIMIT_CORE, &rl);
+    data = mmap(NULL, sizeof(item_t), PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    /* faults once it gets a slot. */
+    while (q != NULL && data != MAP_FAILED &&
+           workqueue_named_submit(q, data, sizeof(item_t)) < 0 &&
+           errno == EAGAIN) {
+        usleep(100);
+    }
+    _exit(1);
+}
+
+static pid_t
+spawn(const char *name, int producer)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        if (producer < 0) {
+            die(name);
+        }
+        _exit(produce(name, producer));
+    }
+    return pid;
+}
+
+static void
+wait_idle(workqueue_t *wq)
+{
+    workqueue_lock(wq);
+    while (!workqueue_idle(wq)) {
+        workqueue_wait(wq, 0);
+    }
+    workqueue_unlock(wq);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *backend = (argc > 1) ? argv[1] : "thread";
+    workqueue_named_stat_t st;
+    workqueue_named_t *q;
+    unsigned int p, i, bad = 0;
+    pid_t pids[PRODUCERS];
+    workqueue_t wq;
+    char name[64];
+    int status;
+
+    if (workqueue_init(&wq, backend) < 0) {
+        perror("workqueue_init");
+        return 1;
+    }
+    wq.max_workers = 4;
+    snprintf(name, sizeof(name), "/wq-named-example-%d", (int)getpid());
+    q = workqueue_named_create(&wq, name, SLOTS, run);
+    if (q == NULL) {
+        perror("workqueue_named_create");
+        return 1;
+    }
+
+    for (p = 0; p < PRODUCERS; p++) {
+        pids[p] = spawn(name, p);
+    }
+    for (p = 0; p < PRODUCERS; p++) {
+        waitpid(pids[p], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("producer %u failed\n", p);
+            bad++;
+        }
+    }
+
+    /* the dead producer's slot holds up the ring until it is given up,
+       then one more producer gets everything through. */
+    waitpid(spawn(name, -1), &status, 0);
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGSEGV) {
+        printf("the dying producer did not fault\n");
+        bad++;
+    }
+    waitpid(spawn(name, PRODUCERS), &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("producer after the dead one failed\n");
+        bad++;
+    }
+
+    /* every slot has been handed to 'wq' once the ring is empty. */
+    do {
+        usleep(1000);
+        workqueue_named_stat(q, &st);
+    } while (st.queued > 0);
+    wait_idle(&wq);
+    if (st.lost != 1 || st.dropped != 0) {
+        printf("%u items lost, %u dropped; 1 and 0 expected\n",
+               st.lost, st.dropped);
+        bad++;
+    }
+
+    for (p = 0; p <= PRODUCERS; p++) {
+        for (i = 0; i < ITEMS; i++) {
+            if (runs[p][i] != 1) {
+                printf("producer %u, item %u ran %u times\n",
+                       p, i, runs[p][i]);
+                bad++;
+                break;
+            }
+        }
+    }
+
+    workqueue_named_destroy(q);
+    workqueue_destroy(&wq);
+    printf("%s: %u failed checks\n", backend, bad);
+    return (bad == 0) ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wq.h>
+
+/* workqueue_parallel_for() and workqueue_parallel_reduce() checked
+   against the same loops run serially: every index must be visited
+   exactly once, and the reductions (a sum and a minimum, over a range
+   that doesn't divide evenly into chunks) must match the serial
+   results.  The grain size varies from one index per chunk to more
+   than the whole range.  The backend ("thread" by default) may be given
+   on the command line. */
+#define N 100003
+
+static unsigned char visits[N];
+static long values[N];
+
+static void
+visit(void *ctx, long b, long e)
+{
+    for (; b < e; b++) {
+        __atomic_add_fetch(&visits[b], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+sum(void *ctx, long b, long e, void *acc)
+{
+    const long *v = ctx;
+
+    for (; b < e; b++) {
+        *(long *)acc += v[b];
+    }
+}
+
+static void
+add(void *ctx, void *result, const void *acc)
+{
+    *(long *)result += *(const long *)acc;
+}
+
+static void
+lowest(void *ctx, long b, long e, void *acc)
+{
+    const long *v = ctx;
+
+    for (; b < e; b++) {
+        if (v[b] < *(long *)acc) {
+            *(long *)acc = v[b];
+        }
+    }
+}
+
+static void
+min(void *ctx, void *result, const void *acc)
+{
+    if (*(const long *)acc < *(long *)result) {
+        *(long *)result = *(const long *)acc;
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *backend = (argc > 1) ? argv[1] : "thread";
+    static const long grains[] = { 1, 7, 0, 1000, N + 1 };
+    long serial_sum = 0, serial_min = 0, zero = 0, max = 0x7fffffffL;
+    long i, g, bad = 0;
+    workqueue_t wq;
+    int rc;
+
+    srand(1);
+    for (i = 0; i < N; i++) {
+        values[i] = rand() % 2001 - 1000;
+        serial_sum += values[i];
+        if (i == 0 || values[i] < serial_min) {
+            serial_min = values[i];
+        }
+    }
+
+    rc = workqueue_init(&wq, backend);
+    if (rc < 0) {
+        perror("workqueue_init");
+        return 1;
+    }
+    wq.max_workers = 4;
+
+    for (g = 0; g < sizeof(grains) / sizeof(grains[0]); g++) {
+        long result;
+
+        memset(visits, 0, sizeof(visits));
+        rc = workqueue_parallel_for(&wq, 0, N, grains[g], visit, NULL);
+        for (i = 0; i < N; i++) {
+            if (visits[i] != 1) {
+                break;
+            }
+        }
+        if (rc != 0 || i < N) {
+            printf("for, grain %ld: index %ld visited %d times\n",
+                   grains[g], i, (i < N) ? visits[i] : 1);
+            bad++;
+        }
+
+        /* the initial value of the result is kept. */
+        result = 5;
+        rc = workqueue_parallel_reduce(&wq, 0, N, grains[g], sum, add,
+                                       values, &result, &zero,
+                                       sizeof(result));
+        if (rc != 0 || result != serial_sum + 5) {
+            printf("sum, grain %ld: %ld, serially %ld\n",
+                   grains[g], result - 5, serial_sum);
+            bad++;
+        }
+
+        result = max;
+        rc = workqueue_parallel_reduce(&wq, 0, N, grains[g], lowest, min,
+                                       values, &result, &max,
+                                       sizeof(result));
+        if (rc != 0 || result != serial_min) {
+            printf("min, grain %ld: %ld, serially %ld\n",
+                   grains[g], result, serial_min);
+            bad++;
+        }
+    }
+
+    /* an empty range is no error and leaves the result alone. */
+    i = 42;
+    rc = workqueue_parallel_reduce(&wq, 10, 10, 0, sum, add, values,
+                                   &i, &zero, sizeof(i));
+    if (rc != 0 || i != 42) {
+        printf("empty range: rc %d, result %ld\n", rc, i);
+        bad++;
+    }
+
+    workqueue_destroy(&wq);
+    printf("%s: %ld failed checks\n", backend, bad);
+    return (bad == 0) ? 0 : 1;
+}
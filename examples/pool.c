@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <wq.h>
+
+/* Weighted sharing of a pool.  Three queues with weights 3, 1 and 2
+   share a pool with a single worker, which is held up until all of them
+   have a backlog.  While every queue still has items, each must get its
+   share of the runs in proportion to its weight, and in the end all the
+   items must have run. */
+#define QUEUES 3
+#define ITEMS 1000
+/* runs looked at: all queues are busy that long. */
+#define WINDOW 1200
+
+static const unsigned int weights[QUEUES] = { 3, 1, 2 };
+static workqueue_t queues[QUEUES];
+static unsigned int order[QUEUES * ITEMS];
+static unsigned int logged;
+static int gate = 1;
+
+static void
+run(int id, void *arg)
+{
+    unsigned int n = __atomic_fetch_add(&logged, 1, __ATOMIC_RELAXED);
+
+    order[n] = (unsigned long)arg;
+}
+
+static void
+hold(int id, void *arg)
+{
+    while (__atomic_load_n(&gate, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned int runs[QUEUES] = { 0 }, total = 0, want, i, q, bad = 0;
+    unsigned long k;
+    workqueue_pool_t *pool;
+
+    pool = workqueue_pool_create(1);
+    if (pool == NULL) {
+        perror("workqueue_pool_create");
+        return 1;
+    }
+    for (q = 0; q < QUEUES; q++) {
+        if (workqueue_init_pool(&queues[q], pool, weights[q]) < 0) {
+            perror("workqueue_init_pool");
+            return 1;
+        }
+        total += weights[q];
+    }
+
+    workqueue_submit(&queues[0], hold, NULL);
+    for (i = 0; i < ITEMS; i++) {
+        for (k = 0; k < QUEUES; k++) {
+            if (workqueue_submit(&queues[k], run, (void *)k) < 0) {
+                perror("workqueue_submit");
+                return 1;
+            }
+        }
+    }
+    __atomic_store_n(&gate, 0, __ATOMIC_RELEASE);
+
+    for (q = 0; q < QUEUES; q++) {
+        workqueue_lock(&queues[q]);
+        while (!workqueue_idle(&queues[q])) {
+            workqueue_wait(&queues[q], 0);
+        }
+        workqueue_unlock(&queues[q]);
+    }
+
+    if (logged != QUEUES * ITEMS) {
+        printf("%u of %u items ran\n", logged, QUEUES * ITEMS);
+        bad++;
+    }
+    for (i = 0; i < WINDOW; i++) {
+        runs[order[i]]++;
+    }
+    for (q = 0; q < QUEUES; q++) {
+        want = WINDOW * weights[q] / total;
+        printf("queue %u, weight %u: %u of the first %u runs, %u due\n",
+               q, weights[q], runs[q], WINDOW, want);
+        /* a round may be cut short by the window. */
+        if (runs[q] + weights[q] < want || runs[q] > want + weights[q]) {
+            bad++;
+        }
+    }
+
+    for (q = 0; q < QUEUES; q++) {
+        workqueue_destroy(&queues[q]);
+    }
+    workqueue_pool_destroy(pool);
+    printf("%u failed checks\n", bad);
+    return (bad == 0) ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <wq.h>
+
+/* Strands.  Several producer threads submit to every strand at once,
+   each numbering its items.  A strand's items must never overlap, and
+   the items of one producer must run in the order it submitted them,
+   even though the strands themselves run in parallel and hop between
+   workers.  Needs a shared-memory backend ("thread" by default, may be
+   given on the command line). */
+#define STRANDS 16
+#define PRODUCERS 4
+#define ITEMS 2000      /* per producer and strand */
+
+typedef struct strand {
+    workqueue_strand_t s;
+    int inside;
+    /* the next number expected from each producer. */
+    unsigned int next[PRODUCERS];
+    unsigned int overlaps;
+    unsigned int misordered;
+} strand_t;
+
+typedef struct item {
+    strand_t *strand;
+    unsigned int producer;
+    unsigned int seq;
+} item_t;
+
+static workqueue_t wq;
+static strand_t strands[STRANDS];
+static item_t items[PRODUCERS][STRANDS][ITEMS];
+
+static void
+run(int id, void *arg)
+{
+    item_t *item = arg;
+    strand_t *s = item->strand;
+
+    if (__atomic_exchange_n(&s->inside, 1, __ATOMIC_ACQUIRE) != 0) {
+        __atomic_add_fetch(&s->overlaps, 1, __ATOMIC_RELAXED);
+    }
+    /* no lock: the strand is the only one touching its counters. */
+    if (s->next[item->producer] != item->seq) {
+        s->misordered++;
+    }
+    s->next[item->producer] = item->seq + 1;
+    __atomic_store_n(&s->inside, 0, __ATOMIC_RELEASE);
+}
+
+static void *
+produce(void *arg)
+{
+    unsigned int p = (unsigned long)arg, i, k;
+
+    for (i = 0; i < ITEMS; i++) {
+        for (k = 0; k < STRANDS; k++) {
+            item_t *item = &items[p][k][i];
+
+            item->strand = &strands[k];
+            item->producer = p;
+            item->seq = i;
+            if (workqueue_strand_submit(&strands[k].s, run, item) < 0) {
+                perror("workqueue_strand_submit");
+                exit(1);
+            }
+        }
+    }
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *backend = (argc > 1) ? argv[1] : "thread";
+    pthread_t producers[PRODUCERS];
+    unsigned long p;
+    unsigned int k, bad = 0;
+    int rc;
+
+    rc = workqueue_init(&wq, backend);
+    if (rc < 0) {
+        perror("workqueue_init");
+        return 1;
+    }
+    wq.max_workers = 4;
+
+    for (k = 0; k < STRANDS; k++) {
+        if (workqueue_strand_init(&strands[k].s, &wq) < 0) {
+            perror("workqueue_strand_init");
+            return 1;
+        }
+    }
+    for (p = 0; p < PRODUCERS; p++) {
+        pthread_create(&producers[p], NULL, produce, (void *)p);
+    }
+    for (p = 0; p < PRODUCERS; p++) {
+        pthread_join(producers[p], NULL);
+    }
+
+    workqueue_lock(&wq);
+    while (!workqueue_idle(&wq)) {
+        workqueue_wait(&wq, 0);
+    }
+    workqueue_unlock(&wq);
+
+    for (k = 0; k < STRANDS; k++) {
+        strand_t *s = &strands[k];
+
+        if (!workqueue_strand_idle(&s->s)) {
+            printf("strand %u not idle\n", k);
+            bad++;
+        }
+        for (p = 0; p < PRODUCERS; p++) {
+            if (s->next[p] != ITEMS) {
+                printf("strand %u: %u of %u items of producer %lu ran\n",
+                       k, s->next[p], ITEMS, p);
+                bad++;
+            }
+        }
+        if (s->overlaps > 0 || s->misordered > 0) {
+            printf("strand %u: %u overlapping, %u out of order\n",
+                   k, s->overlaps, s->misordered);
+            bad++;
+        }
+        workqueue_strand_destroy(&s->s);
+    }
+    workqueue_destroy(&wq);
+
+    printf("%s: %u failed checks\n", backend, bad);
+    return (bad == 0) ? 0 : 1;
+}
@@ -0,0 +1,75 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#ifndef __ATOMIC_H__
+#define __ATOMIC_H__
+
+/* Thin wrappers around the GCC/clang __atomic builtins, plus cache line
+   aligned allocation for data they operate on. */
+
+#include <stdlib.h>
+#ifdef __WIN32
+#include <malloc.h>
+#endif
+
+#define CACHELINE_SIZE 64
+#define __cacheline_aligned __attribute__((aligned(CACHELINE_SIZE)))
+
+static inline void *
+wq_aligned_alloc(size_t size)
+{
+    void *p;
+#ifdef __WIN32
+    p = _aligned_malloc(size, CACHELINE_SIZE);
+#else
+    if (posix_memalign(&p, CACHELINE_SIZE, size) != 0) {
+        p = NULL;
+    }
+#endif
+    return p;
+}
+
+static inline void
+wq_aligned_free(void *p)
+{
+#ifdef __WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+#define wq_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define wq_atomic_load_relaxed(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define wq_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define wq_atomic_store_relaxed(p, v)                                   \
+    __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define wq_atomic_fetch_add(p, v)                                       \
+    __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+#define wq_atomic_add_fetch(p, v)                                       \
+    __atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+#define wq_atomic_sub_fetch(p, v)                                       \
+    __atomic_sub_fetch((p), (v), __ATOMIC_ACQ_REL)
+#define wq_atomic_exchange(p, v)                                        \
+    __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define wq_atomic_cas(p, expected, desired)                             \
+    __atomic_compare_exchange_n((p), (expected), (desired), false,      \
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+#endif /* __ATOMIC_H__ */
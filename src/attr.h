@@ -0,0 +1,53 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#ifndef __ATTR_H__
+#define __ATTR_H__
+
+/* Thread attributes for the threads started on behalf of a queue. */
+
+#include <limits.h>
+#include <pthread.h>
+
+#ifndef PTHREAD_STACK_MIN
+#define PTHREAD_STACK_MIN 16384
+#endif
+
+/* a 'stack_size' or 'guard_size' of 0 keeps the system default. */
+static inline void
+workqueue_attr_init(pthread_attr_t *attr, size_t stack_size,
+                    size_t guard_size)
+{
+    pthread_attr_init(attr);
+    if (stack_size > 0) {
+        if (stack_size < PTHREAD_STACK_MIN) {
+            stack_size = PTHREAD_STACK_MIN;
+        }
+        pthread_attr_setstacksize(attr, stack_size);
+    }
+#ifndef __WIN32
+    if (guard_size == WORKQUEUE_GUARD_NONE) {
+        pthread_attr_setguardsize(attr, 0);
+    } else if (guard_size > 0) {
+        pthread_attr_setguardsize(attr, guard_size);
+    }
+#endif
+}
+
+#endif /* __ATTR_H__ */
@@ -0,0 +1,149 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#ifndef __COUNTERS_H__
+#define __COUNTERS_H__
+
+/* Worker accounting shared by the pthread based backends.
+
+   The counters are updated with atomics so that, once a queue is busy,
+   neither submitters nor workers need the queue lock: a submitter bumps
+   'queued' and writes the pipe, a worker reads the pipe and moves
+   between 'available' and busy.  The lock is only taken to sleep and to
+   wake sleepers.  To make that safe, whoever holds the lock is recorded
+   in 'owner' and whoever sleeps is counted in 'sleepers' or 'waiters';
+   a thread that has just made progress then only needs the lock when
+   one of those is non-zero (see workqueue_counters_contended()). */
+
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "atomic.h"
+
+typedef struct workqueue_counters {
+    /* written by every submit and every item. */
+    unsigned int queued __cacheline_aligned;
+    /* written by every item. */
+    unsigned int available __cacheline_aligned;
+    /* the rest is read-mostly while the queue is busy. */
+    unsigned int current __cacheline_aligned;
+    /* workers blocked waiting for items. */
+    unsigned int sleepers;
+    /* callers blocked in workqueue_wait(). */
+    unsigned int waiters;
+    /* workers in a workqueue_blocking_begin/end() region. */
+    unsigned int blocked;
+    bool shutdown;
+    /* workqueue_token() of the lock holder, 0 if unlocked. */
+    unsigned long long owner;
+} workqueue_counters_t;
+
+/* per-thread identity, unique across the processes sharing a queue;
+   defined in wq.c. */
+extern __thread unsigned long long workqueue_thread_token;
+unsigned long long workqueue_token_new(void);
+
+static inline unsigned long long
+workqueue_token(void)
+{
+    if (workqueue_thread_token == 0) {
+        workqueue_thread_token = workqueue_token_new();
+    }
+    return workqueue_thread_token;
+}
+
+static inline void
+workqueue_counters_stat(workqueue_counters_t *c, workqueue_stat_t *st)
+{
+    st->available = wq_atomic_load(&c->available);
+    st->current = wq_atomic_load(&c->current);
+    st->queued = wq_atomic_load(&c->queued);
+    st->shutdown = wq_atomic_load(&c->shutdown);
+    st->blocked = wq_atomic_load(&c->blocked);
+}
+
+static inline void
+workqueue_counters_blocking(workqueue_counters_t *c, int n)
+{
+    wq_atomic_add_fetch(&c->blocked, n);
+}
+
+static inline bool
+workqueue_counters_owned(workqueue_counters_t *c)
+{
+    return wq_atomic_load_relaxed(&c->owner) == workqueue_token();
+}
+
+static inline void
+workqueue_counters_lock(workqueue_counters_t *c, pthread_mutex_t *mutex)
+{
+#if defined(EOWNERDEAD) && !defined(__WIN32)
+    /* a robust, process-shared, mutex whose holder died. */
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+        pthread_mutex_consistent(mutex);
+    }
+#else
+    pthread_mutex_lock(mutex);
+#endif
+    __atomic_store_n(&c->owner, workqueue_token(), __ATOMIC_SEQ_CST);
+}
+
+static inline void
+workqueue_counters_unlock(workqueue_counters_t *c, pthread_mutex_t *mutex)
+{
+    assert(workqueue_counters_owned(c));
+    wq_atomic_store(&c->owner, 0);
+    pthread_mutex_unlock(mutex);
+}
+
+/* Bracket a condition wait on 'mutex'.  'count' (sleepers or waiters)
+   goes up before the owner is cleared, so anyone who misses the owner
+   sees the count instead. */
+static inline void
+workqueue_counters_sleep(workqueue_counters_t *c, unsigned int *count)
+{
+    if (count != NULL) {
+        __atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+    }
+    __atomic_store_n(&c->owner, 0, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+workqueue_counters_wake(workqueue_counters_t *c, unsigned int *count)
+{
+    __atomic_store_n(&c->owner, workqueue_token(), __ATOMIC_SEQ_CST);
+    if (count != NULL) {
+        __atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* Called after publishing progress (an item in the pipe, a completed
+   item).  Returns true if a thread may have checked the state before
+   that progress and be about to sleep, or be asleep, on the condition
+   behind 'count'; the caller must then lock and signal. */
+static inline bool
+workqueue_counters_contended(workqueue_counters_t *c, unsigned int *count)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&c->owner, __ATOMIC_SEQ_CST) != 0 ||
+        __atomic_load_n(count, __ATOMIC_SEQ_CST) != 0;
+}
+
+#endif /* __COUNTERS_H__ */
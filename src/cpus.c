@@ -0,0 +1,263 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __WIN32
+#include <windows.h>
+#endif
+
+#include <wq.h>
+
+#include "atomic.h"
+#include "cpus.h"
+
+/* The number of CPUs this process can actually use: the affinity mask,
+   further limited by a cgroup (v1 or v2) CPU quota as set up by
+   container runtimes.  Both can change at run time: the cached value is
+   recomputed by workqueue_cpus_update() once it is older than
+   WORKQUEUE_CPUS_INTERVAL seconds.  That is called by the manager
+   thread, idle pool workers and workqueue_stat(), never on the submit
+   path. */
+#define WORKQUEUE_CPUS_INTERVAL 10
+
+static unsigned int workqueue_cpus_cached;
+static long long workqueue_cpus_stamp;
+
+static unsigned int
+workqueue_cpus_online(void)
+{
+#if defined(__WIN32)
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
+#else
+    long n;
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        return CPU_COUNT(&set);
+    }
+#endif
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (unsigned int)n : 1;
+#endif
+}
+
+#ifdef __linux__
+/* Returns the quota in CPUs (rounded up), or 0 for no limit. */
+static unsigned int
+workqueue_cpus_quota(long long quota, long long period)
+{
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+    return (unsigned int)((quota + period - 1) / period);
+}
+
+static unsigned int
+workqueue_cpus_min(unsigned int a, unsigned int b)
+{
+    if (a == 0) {
+        return b;
+    }
+    return (b != 0 && b < a) ? b : a;
+}
+
+/* cgroup v2: "max 100000" or "<quota> <period>" in cpu.max, checked for
+   the cgroup and every ancestor since any of them may be limited. */
+static unsigned int
+workqueue_cpus_cgroup2(const char *cgroup)
+{
+    char path[512], dir[256];
+    unsigned int n = 0;
+
+    snprintf(dir, sizeof(dir), "%s", cgroup);
+    while (1) {
+        char *slash;
+        FILE *fp;
+
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max",
+                 (strcmp(dir, "/") == 0) ? "" : dir);
+        fp = fopen(path, "r");
+        if (fp != NULL) {
+            char quota[32];
+            long long period;
+
+            if (fscanf(fp, "%31s %lld", quota, &period) == 2 &&
+                strcmp(quota, "max") != 0) {
+                n = workqueue_cpus_min(n, workqueue_cpus_quota(
+                                           atoll(quota), period));
+            }
+            fclose(fp);
+        }
+
+        slash = strrchr(dir, '/');
+        if (slash == NULL || slash == dir) {
+            if (strcmp(dir, "/") == 0) {
+                break;
+            }
+            strcpy(dir, "/");
+        } else {
+            *slash = '\0';
+        }
+    }
+    return n;
+}
+
+static long long
+workqueue_cpus_read(const char *dir, const char *cgroup, const char *file)
+{
+    char path[512];
+    long long value = -1;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s%s/%s", dir, cgroup, file);
+    fp = fopen(path, "r");
+    if (fp != NULL) {
+        if (fscanf(fp, "%lld", &value) != 1) {
+            value = -1;
+        }
+        fclose(fp);
+    }
+    return value;
+}
+
+/* cgroup v1: cpu.cfs_quota_us / cpu.cfs_period_us of the 'cpu'
+   controller.  Inside a container the controller is usually mounted at
+   the container's own cgroup, so the root of the mount is tried too. */
+static unsigned int
+workqueue_cpus_cgroup1(const char *cgroup)
+{
+    static const char *dirs[] = {
+        "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct", NULL
+    };
+    unsigned int i, n = 0;
+
+    for (i = 0; dirs[i] != NULL && n == 0; i++) {
+        long long quota, period;
+
+        quota = workqueue_cpus_read(dirs[i], cgroup, "cpu.cfs_quota_us");
+        period = workqueue_cpus_read(dirs[i], cgroup, "cpu.cfs_period_us");
+        if (quota < 0 || period < 0) {
+            quota = workqueue_cpus_read(dirs[i], "", "cpu.cfs_quota_us");
+            period = workqueue_cpus_read(dirs[i], "", "cpu.cfs_period_us");
+        }
+        n = workqueue_cpus_quota(quota, period);
+    }
+    return n;
+}
+
+static unsigned int
+workqueue_cpus_cgroup(void)
+{
+    char line[512];
+    unsigned int n = 0;
+    FILE *fp;
+
+    fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    /* "<id>:<controllers>:<path>", v2 is "0::<path>". */
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *controllers, *cgroup;
+
+        line[strcspn(line, "\n")] = '\0';
+        controllers = strchr(line, ':');
+        if (controllers == NULL) {
+            continue;
+        }
+        controllers++;
+        cgroup = strchr(controllers, ':');
+        if (cgroup == NULL) {
+            continue;
+        }
+        *cgroup++ = '\0';
+
+        if (*controllers == '\0') {
+            n = workqueue_cpus_min(n, workqueue_cpus_cgroup2(cgroup));
+        } else {
+            char *c, *save = NULL;
+
+            for (c = strtok_r(controllers, ",", &save); c != NULL;
+                 c = strtok_r(NULL, ",", &save)) {
+                if (strcmp(c, "cpu") == 0) {
+                    n = workqueue_cpus_min(n, workqueue_cpus_cgroup1(cgroup));
+                    break;
+                }
+            }
+        }
+    }
+    fclose(fp);
+    return n;
+}
+#endif
+
+static unsigned int
+workqueue_cpus_compute(void)
+{
+    unsigned int n = workqueue_cpus_online();
+#ifdef __linux__
+    unsigned int quota = workqueue_cpus_cgroup();
+
+    if (quota != 0 && quota < n) {
+        n = quota;
+    }
+#endif
+    return (n > 0) ? n : 1;
+}
+
+unsigned int
+workqueue_cpus(void)
+{
+    unsigned int n = wq_atomic_load(&workqueue_cpus_cached);
+
+    if (n == 0) {
+        n = workqueue_cpus_update();
+    }
+    return n;
+}
+
+/* racing updates are harmless, they store the same value. */
+unsigned int
+workqueue_cpus_update(void)
+{
+    long long now = (long long)time(NULL);
+    unsigned int n = wq_atomic_load(&workqueue_cpus_cached);
+
+    if (n == 0 ||
+        now - wq_atomic_load_relaxed(&workqueue_cpus_stamp) >=
+        WORKQUEUE_CPUS_INTERVAL) {
+        n = workqueue_cpus_compute();
+        wq_atomic_store_relaxed(&workqueue_cpus_stamp, now);
+        wq_atomic_store(&workqueue_cpus_cached, n);
+    }
+    return n;
+}
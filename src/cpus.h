@@ -0,0 +1,29 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#ifndef __CPUS_H__
+#define __CPUS_H__
+
+/* the number of CPUs available to this process, see cpus.c. */
+unsigned int workqueue_cpus(void);
+/* re-reads the affinity mask and cgroup quota if the cached value is
+   stale, returns the current value. */
+unsigned int workqueue_cpus_update(void);
+
+#endif /* __CPUS_H__ */
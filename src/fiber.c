@@ -0,0 +1,348 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#include <stdlib.h>
+#include <stdint.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include <wq.h>
+
+#include "fiber.h"
+
+/* Fibers: with the "fiber" backend, every item runs on a small stack of
+   its own instead of the worker thread's.  When the item has to wait
+   (workqueue_graph_wait(), a nested workqueue_parallel_for(),
+   workqueue_yield()) the fiber is parked and its worker moves on to the
+   next item.  Resuming a fiber is just another item, which any worker
+   may pick up, so a fiber may continue on another thread than it
+   started on.
+
+   Stacks are mapped without reserving swap and only the pages a fiber
+   touches are committed, so a queue can hold many more parked tasks
+   than it has threads.  Each stack gets a PROT_NONE guard below it, one
+   page unless wq->guard_size asks for more: a small stack is easy to
+   overflow, and the fault is better than silently corrupting the
+   neighbouring mapping.  A guard splits the mapping in two, and the
+   number of mappings per process is limited (vm.max_map_count), so
+   queues with very many parked fibers may set WORKQUEUE_GUARD_NONE. */
+
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+#define WORKQUEUE_FIBER_STACK (64 * 1024)
+/* stacks kept for reuse, beyond the one each worker keeps. */
+#define WORKQUEUE_FIBER_CACHE 1024
+
+typedef struct workqueue_fiber {
+    ucontext_t ctx;
+    workqueue_t *wq;
+    work_item_t item;
+    /* the item's descriptor, see workqueue_fiber_fd(). */
+    int fd;
+    bool done;
+    char *map;
+    size_t map_size;
+    /* on the free list or a waiter list. */
+    struct workqueue_fiber *next;
+} workqueue_fiber_t;
+
+typedef struct workqueue_fiber_worker {
+    ucontext_t ctx;
+    workqueue_fiber_t *current;
+    workqueue_fiber_t *spare;
+    /* run by the worker once the parking fiber is off its stack. */
+    void (*post)(void *);
+    void *post_arg;
+} workqueue_fiber_worker_t;
+
+static __thread workqueue_fiber_worker_t workqueue_fiber_worker;
+
+static pthread_mutex_t workqueue_fiber_mutex = PTHREAD_MUTEX_INITIALIZER;
+static workqueue_fiber_t *workqueue_fiber_free;
+static unsigned int workqueue_fiber_nfree;
+
+/* A fiber may continue on another thread, where the compiler must not
+   reuse the address of the previous thread's variables: always look
+   them up through here. */
+static workqueue_fiber_worker_t * __attribute__((noinline))
+workqueue_fiber_self(void)
+{
+    workqueue_fiber_worker_t *w = &workqueue_fiber_worker;
+    __asm__ __volatile__("" : "+r" (w));
+    return w;
+}
+
+static void
+workqueue_fiber_unmap(workqueue_fiber_t *f)
+{
+    munmap(f->map, f->map_size);
+    free(f);
+}
+
+static void
+workqueue_fiber_main(unsigned int hi, unsigned int lo)
+{
+    workqueue_fiber_t *f;
+
+    f = (workqueue_fiber_t *)(uintptr_t)(((unsigned long long)hi << 32) |
+                                         lo);
+    while (1) {
+        f->item.func(workqueue_self(f->wq), (f->item.size > 0) ?
+                     f->item.u.data : f->item.arg);
+        f->done = true;
+        /* back to the worker, which reuses it for another item. */
+        swapcontext(&f->ctx, &workqueue_fiber_self()->ctx);
+    }
+}
+
+static workqueue_fiber_t *
+workqueue_fiber_new(workqueue_t *wq)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (wq->stack_size > 0) ? wq->stack_size :
+        WORKQUEUE_FIBER_STACK;
+    size_t guard = (wq->guard_size == WORKQUEUE_GUARD_NONE) ? 0 :
+        (wq->guard_size > 0) ? wq->guard_size : page;
+    unsigned long long p;
+    workqueue_fiber_t *f;
+
+    size = (size + guard + page - 1) & ~(page - 1);
+    guard = (guard + page - 1) & ~(page - 1);
+
+    f = calloc(1, sizeof(workqueue_fiber_t));
+    if (f == NULL) {
+        return NULL;
+    }
+    f->map_size = size;
+    f->map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                  -1, 0);
+    if (f->map == MAP_FAILED) {
+        free(f);
+        return NULL;
+    }
+    /* stacks grow down. */
+    if (guard > 0 && mprotect(f->map, guard, PROT_NONE) < 0) {
+        workqueue_fiber_unmap(f);
+        return NULL;
+    }
+
+    getcontext(&f->ctx);
+    f->ctx.uc_stack.ss_sp = f->map + guard;
+    f->ctx.uc_stack.ss_size = size - guard;
+    f->ctx.uc_link = NULL;
+    p = (uintptr_t)f;
+    makecontext(&f->ctx, (void (*)(void))workqueue_fiber_main, 2,
+                (unsigned int)(p >> 32), (unsigned int)p);
+    return f;
+}
+
+static workqueue_fiber_t *
+workqueue_fiber_get(workqueue_t *wq)
+{
+    workqueue_fiber_worker_t *w = workqueue_fiber_self();
+    workqueue_fiber_t *f = w->spare;
+
+    if (f != NULL) {
+        w->spare = NULL;
+        return f;
+    }
+
+    pthread_mutex_lock(&workqueue_fiber_mutex);
+    f = workqueue_fiber_free;
+    if (f != NULL) {
+        workqueue_fiber_free = f->next;
+        workqueue_fiber_nfree--;
+    }
+    pthread_mutex_unlock(&workqueue_fiber_mutex);
+    if (f != NULL) {
+        return f;
+    }
+    return workqueue_fiber_new(wq);
+}
+
+static void
+workqueue_fiber_cache(workqueue_fiber_t *f)
+{
+    pthread_mutex_lock(&workqueue_fiber_mutex);
+    if (workqueue_fiber_nfree < WORKQUEUE_FIBER_CACHE) {
+        f->next = workqueue_fiber_free;
+        workqueue_fiber_free = f;
+        workqueue_fiber_nfree++;
+        f = NULL;
+    }
+    pthread_mutex_unlock(&workqueue_fiber_mutex);
+    if (f != NULL) {
+        workqueue_fiber_unmap(f);
+    }
+}
+
+static void
+workqueue_fiber_put(workqueue_fiber_t *f)
+{
+    workqueue_fiber_worker_t *w = workqueue_fiber_self();
+
+    if (w->spare == NULL) {
+        w->spare = f;
+    } else {
+        workqueue_fiber_cache(f);
+    }
+}
+
+/* never called: the worker switches to the fiber in 'arg' instead. */
+void
+workqueue_fiber_resume(int id, void *arg)
+{
+}
+
+workqueue_fiber_t **
+workqueue_fiber_next(workqueue_fiber_t *f)
+{
+    return &f->next;
+}
+
+/* Not through the pipe: it is bounded, and a worker blocked writing a
+   resume to a full pipe could never drain it. */
+static void
+workqueue_fiber_requeue(void *arg)
+{
+    workqueue_fiber_t *f = arg;
+    f->wq->backend->resume(f->wq, f);
+}
+
+static void
+workqueue_fiber_unlock(void *arg)
+{
+    pthread_mutex_unlock(arg);
+}
+
+/* Switches back to the worker, which runs post(arg) once the fiber is
+   off its stack: until then nobody may resume it. */
+static void
+workqueue_fiber_park(void (*post)(void *), void *arg)
+{
+    workqueue_fiber_worker_t *w = workqueue_fiber_self();
+    workqueue_fiber_t *f = w->current;
+
+    w->post = post;
+    w->post_arg = arg;
+    swapcontext(&f->ctx, &w->ctx);
+}
+
+void
+workqueue_fiber_run(workqueue_t *wq, work_item_t *item)
+{
+    workqueue_fiber_worker_t *w = workqueue_fiber_self();
+    workqueue_fiber_t *f;
+
+    if (item->func == workqueue_fiber_resume) {
+        f = item->arg;
+    } else {
+        f = workqueue_fiber_get(wq);
+        if (f == NULL) {
+            /* no stack to be had: run it on the worker's own. */
+            item->func(workqueue_self(wq), (item->size > 0) ?
+                       item->u.data : item->arg);
+            return;
+        }
+        f->wq = wq;
+        f->item = *item;
+        f->fd = -1;
+        f->done = false;
+    }
+
+    w->current = f;
+    swapcontext(&w->ctx, &f->ctx);
+    w->current = NULL;
+
+    if (f->done) {
+        workqueue_fiber_put(f);
+    } else if (w->post != NULL) {
+        void (*post)(void *) = w->post;
+
+        w->post = NULL;
+        post(w->post_arg);
+    }
+}
+
+void
+workqueue_fiber_worker_exit(void)
+{
+    workqueue_fiber_worker_t *w = workqueue_fiber_self();
+
+    if (w->spare != NULL) {
+        workqueue_fiber_cache(w->spare);
+        w->spare = NULL;
+    }
+}
+
+int
+workqueue_fiber_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                          workqueue_fiber_t **waiters)
+{
+    workqueue_fiber_t *f = workqueue_fiber_self()->current;
+
+    if (f == NULL) {
+        return pthread_cond_wait(cond, mutex);
+    }
+    f->next = *waiters;
+    *waiters = f;
+    workqueue_fiber_park(workqueue_fiber_unlock, mutex);
+    pthread_mutex_lock(mutex);
+    return 0;
+}
+
+void
+workqueue_fiber_wake_all(workqueue_fiber_t *waiters)
+{
+    while (waiters != NULL) {
+        workqueue_fiber_t *f = waiters;
+
+        /* it may run, and be parked again, as soon as it's submitted. */
+        waiters = f->next;
+        workqueue_fiber_requeue(f);
+    }
+}
+
+int *
+workqueue_fiber_fd(void)
+{
+    workqueue_fiber_t *f = workqueue_fiber_self()->current;
+    return (f != NULL) ? &f->fd : NULL;
+}
+
+void
+workqueue_yield(void)
+{
+    workqueue_fiber_t *f = workqueue_fiber_self()->current;
+
+    if (f == NULL) {
+        sched_yield();
+        return;
+    }
+    workqueue_fiber_park(workqueue_fiber_requeue, f);
+}
@@ -0,0 +1,75 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#ifndef __FIBER_H__
+#define __FIBER_H__
+
+/* Fibers for the "fiber" backend, see fiber.c.
+
+   Blocking waits inside the library go through
+   workqueue_fiber_cond_wait(): on a fiber it parks the fiber on a
+   waiter list instead of the worker thread, and whoever signals the
+   condition resumes the list with workqueue_fiber_wake_all() once it
+   has dropped the mutex. */
+
+#include <pthread.h>
+
+struct workqueue_fiber;
+
+#ifndef __WIN32
+int workqueue_fiber_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                              struct workqueue_fiber **waiters);
+void workqueue_fiber_wake_all(struct workqueue_fiber *waiters);
+
+/* runs an item on a fiber, the backend's run hook. */
+void workqueue_fiber_run(workqueue_t *wq, struct work_item *item);
+/* releases what the calling worker thread cached. */
+void workqueue_fiber_worker_exit(void);
+
+/* A backend's resume hook queues a parked fiber on a list of its own,
+   linked through workqueue_fiber_next(), and hands it back to the run
+   hook as a workqueue_fiber_resume() item with the fiber as 'arg'. */
+struct workqueue_fiber **workqueue_fiber_next(struct workqueue_fiber *f);
+void workqueue_fiber_resume(int id, void *arg);
+
+/* where the item running on the calling fiber keeps its descriptor, NULL
+   off a fiber.  A parked item's descriptor must stay with it rather than
+   in a thread variable of the worker it parked on. */
+int *workqueue_fiber_fd(void);
+#else
+static inline int
+workqueue_fiber_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                          struct workqueue_fiber **waiters)
+{
+    return pthread_cond_wait(cond, mutex);
+}
+
+static inline void
+workqueue_fiber_wake_all(struct workqueue_fiber *waiters)
+{
+}
+
+static inline int *
+workqueue_fiber_fd(void)
+{
+    return NULL;
+}
+#endif
+
+#endif /* __FIBER_H__ */
@@ -0,0 +1,357 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <wq.h>
+
+#include "atomic.h"
+#include "fiber.h"
+#include "scratch.h"
+
+struct workqueue_node {
+    int (*func)(int, void *);
+    void *arg;
+    workqueue_graph_t *graph;
+    workqueue_node_t *next;
+
+    workqueue_node_t **succs;
+    unsigned int nsuccs;
+    unsigned int maxsuccs;
+    unsigned int npreds;
+
+    /* per run */
+    unsigned int pending;
+    bool skip;
+    /* on a worker's list of ready nodes it couldn't submit. */
+    workqueue_node_t *local;
+};
+
+struct workqueue_graph {
+    workqueue_t *wq;
+    workqueue_node_t *head;
+    workqueue_node_t **tail;
+    unsigned int nnodes;
+
+    unsigned int remaining;
+    int error;
+    bool running;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    /* fibers parked in workqueue_graph_wait(). */
+    struct workqueue_fiber *fibers;
+};
+
+workqueue_graph_t *
+workqueue_graph_create(workqueue_t *wq)
+{
+    workqueue_graph_t *g;
+
+    if (wq == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    g = calloc(1, sizeof(*g));
+    if (g == NULL) {
+        return NULL;
+    }
+    g->wq = wq;
+    g->tail = &g->head;
+    pthread_mutex_init(&g->mutex, NULL);
+    pthread_cond_init(&g->cond, NULL);
+    return g;
+}
+
+void
+workqueue_graph_destroy(workqueue_graph_t *g)
+{
+    workqueue_node_t *n, *next;
+
+    if (g == NULL) {
+        return;
+    }
+    if (wq_atomic_load(&g->running)) {
+        workqueue_graph_wait(g);
+    }
+    for (n = g->head; n != NULL; n = next) {
+        next = n->next;
+        free(n->succs);
+        free(n);
+    }
+    pthread_mutex_destroy(&g->mutex);
+    pthread_cond_destroy(&g->cond);
+    free(g);
+}
+
+workqueue_node_t *
+workqueue_graph_add(workqueue_graph_t *g, int (* func)(int, void *),
+                    void *arg)
+{
+    workqueue_node_t *n;
+
+    if (g == NULL || func == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (wq_atomic_load(&g->running)) {
+        errno = EBUSY;
+        return NULL;
+    }
+    n = calloc(1, sizeof(*n));
+    if (n == NULL) {
+        return NULL;
+    }
+    n->func = func;
+    n->arg = arg;
+    n->graph = g;
+    *g->tail = n;
+    g->tail = &n->next;
+    g->nnodes++;
+    return n;
+}
+
+int
+workqueue_graph_depend(workqueue_graph_t *g, workqueue_node_t *node,
+                       workqueue_node_t *dep)
+{
+    if (g == NULL || node == NULL || dep == NULL || node == dep ||
+        node->graph != g || dep->graph != g) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (wq_atomic_load(&g->running)) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (dep->nsuccs == dep->maxsuccs) {
+        unsigned int max = (dep->maxsuccs) ? dep->maxsuccs * 2 : 4;
+        workqueue_node_t **succs;
+
+        succs = realloc(dep->succs, max * sizeof(*succs));
+        if (succs == NULL) {
+            return -1;
+        }
+        dep->succs = succs;
+        dep->maxsuccs = max;
+    }
+    dep->succs[dep->nsuccs++] = node;
+    node->npreds++;
+    return 0;
+}
+
+static void workqueue_graph_node_run(int id, void *arg);
+
+/* Runs 'n' and then, as long as one of its successors became ready,
+   continues with that successor on this worker while submitting the
+   others, so a chain of dependencies stays on one (cache-warm) worker.
+   Successors that can't be submitted are run here once the chain
+   ends, from a list rather than recursively.  'reset' is false when
+   the caller of workqueue_graph_run() does this itself: its own scratch
+   memory must survive. */
+static void
+workqueue_graph_execute(workqueue_node_t *n, int id, bool reset)
+{
+    workqueue_graph_t *g = n->graph;
+    workqueue_node_t *local = NULL;
+
+    while (n != NULL) {
+        workqueue_node_t *next = NULL;
+        bool failed = wq_atomic_load_relaxed(&n->skip);
+        unsigned int i;
+
+        if (!failed) {
+            int rc = n->func(id, n->arg);
+            if (reset) {
+                workqueue_scratch_done();
+            }
+            if (rc != 0) {
+                int expected = 0;
+                wq_atomic_cas(&g->error, &expected, rc);
+                failed = true;
+            }
+        }
+
+        for (i = 0; i < n->nsuccs; i++) {
+            workqueue_node_t *s = n->succs[i];
+
+            if (failed) {
+                wq_atomic_store_relaxed(&s->skip, true);
+            }
+            if (wq_atomic_sub_fetch(&s->pending, 1) != 0) {
+                continue;
+            }
+            if (next == NULL) {
+                next = s;
+            } else if (workqueue_submit(g->wq, workqueue_graph_node_run,
+                                        s) < 0) {
+                /* can't hand it off, keep it for later. */
+                s->local = local;
+                local = s;
+            }
+        }
+
+        if (wq_atomic_sub_fetch(&g->remaining, 1) == 0) {
+            struct workqueue_fiber *fibers;
+
+            pthread_mutex_lock(&g->mutex);
+            g->running = false;
+            pthread_cond_broadcast(&g->cond);
+            fibers = g->fibers;
+            g->fibers = NULL;
+            pthread_mutex_unlock(&g->mutex);
+            workqueue_fiber_wake_all(fibers);
+        }
+        if (next == NULL && local != NULL) {
+            next = local;
+            local = local->local;
+        }
+        n = next;
+    }
+}
+
+static void
+workqueue_graph_node_run(int id, void *arg)
+{
+    workqueue_graph_execute((workqueue_node_t *)arg, id, true);
+}
+
+/* Kahn's algorithm: returns the nodes in a topological order, or NULL
+   with errno set to EDEADLK if there is a cycle. */
+static workqueue_node_t **
+workqueue_graph_order(workqueue_graph_t *g)
+{
+    workqueue_node_t **order, *n;
+    unsigned int head = 0, tail = 0, i;
+
+    order = malloc((g->nnodes + 1) * sizeof(*order));
+    if (order == NULL) {
+        return NULL;
+    }
+    for (n = g->head; n != NULL; n = n->next) {
+        n->pending = n->npreds;
+        if (n->pending == 0) {
+            order[tail++] = n;
+        }
+    }
+    while (head < tail) {
+        n = order[head++];
+        for (i = 0; i < n->nsuccs; i++) {
+            if (--n->succs[i]->pending == 0) {
+                order[tail++] = n->succs[i];
+            }
+        }
+    }
+    if (tail != g->nnodes) {
+        free(order);
+        errno = EDEADLK;
+        return NULL;
+    }
+    return order;
+}
+
+int
+workqueue_graph_run(workqueue_graph_t *g)
+{
+    workqueue_node_t **order, *n;
+    unsigned int i, nroots = 0;
+
+    if (g == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (wq_atomic_load(&g->running)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    order = workqueue_graph_order(g);
+    if (order == NULL) {
+        return -1;
+    }
+
+    g->error = 0;
+    for (n = g->head; n != NULL; n = n->next) {
+        n->pending = n->npreds;
+        n->skip = false;
+        if (n->npreds == 0) {
+            nroots++;
+        }
+    }
+    if (g->nnodes == 0) {
+        free(order);
+        return 0;
+    }
+
+    g->remaining = g->nnodes;
+    g->running = true;
+
+    if (!(g->wq->backend->flags & WORKQUEUE_BACKEND_SHARED_MEMORY)) {
+        /* workers can't report back: run it here, in order. */
+        for (i = 0; i < g->nnodes; i++) {
+            n = order[i];
+            if (!n->skip) {
+                int rc = n->func(0, n->arg);
+                if (rc != 0 && g->error == 0) {
+                    g->error = rc;
+                }
+                if (rc != 0) {
+                    n->skip = true;
+                }
+            }
+            if (n->skip) {
+                unsigned int j;
+                for (j = 0; j < n->nsuccs; j++) {
+                    n->succs[j]->skip = true;
+                }
+            }
+        }
+        g->remaining = 0;
+        g->running = false;
+        free(order);
+        return 0;
+    }
+
+    /* roots come first in the order. */
+    for (i = 0; i < nroots; i++) {
+        if (workqueue_submit(g->wq, workqueue_graph_node_run,
+                             order[i]) < 0) {
+            workqueue_graph_execute(order[i], 0, false);
+        }
+    }
+    free(order);
+    return 0;
+}
+
+int
+workqueue_graph_wait(workqueue_graph_t *g)
+{
+    if (g == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&g->mutex);
+    while (g->running) {
+        workqueue_fiber_cond_wait(&g->cond, &g->mutex, &g->fibers);
+    }
+    pthread_mutex_unlock(&g->mutex);
+    return wq_atomic_load(&g->error);
+}
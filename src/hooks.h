@@ -0,0 +1,42 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#ifndef __HOOKS_H__
+#define __HOOKS_H__
+
+/* Running the per-worker start/stop hooks, defined in wq.c.  Every
+   worker loop calls workqueue_hooks_start() before its first item and
+   workqueue_hooks_stop() after its last one, both without any lock. */
+
+extern __thread void *workqueue_worker_ctx;
+/* the descriptor received with the running item, closed by the worker
+   loop once it has run; see workqueue_submit_fd(). */
+extern __thread int workqueue_item_fdesc;
+
+void workqueue_hooks_start(workqueue_t *wq);
+void workqueue_hooks_stop(workqueue_t *wq);
+
+/* for loops exiting without a stop hook. */
+static inline void
+workqueue_hooks_clear(void)
+{
+    workqueue_worker_ctx = NULL;
+}
+
+#endif /* __HOOKS_H__ */
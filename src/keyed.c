@@ -0,0 +1,271 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <wq.h>
+
+#include "atomic.h"
+#include "keyed.h"
+#include "scratch.h"
+
+/* Keyed submission.  Each queue lazily gets one lane per worker slot
+   and a key always hashes to the same lane.  A lane is not a thread of
+   its own: like a strand, it is run by a single item queued when it
+   gets work, so it is served by the queue's own workers and counted,
+   spawned and limited like any other item.  That item runs the lane's
+   items back to back; every WORKQUEUE_LANE_BATCH items it queues itself
+   again to let other work in.
+
+   Lane n belongs to the worker in slot n: with backends that have
+   push_worker ("thread" and "fiber") its item always goes to that
+   worker, so a key keeps running on the same thread and its state stays
+   in that thread's cache.  Only if the owner stays busy for a while may
+   a worker about to go idle take it over, once.  Without push_worker,
+   or while slot n has no worker, the item goes to any worker.
+
+   Hot keys: once its home lane has more than WORKQUEUE_LANE_HOT items
+   queued, a key may also use one alternate lane (the less loaded of the
+   two wins), so a single key never spreads over more than two lanes. */
+#define WORKQUEUE_LANE_HOT 32
+#define WORKQUEUE_LANE_BATCH 64
+
+typedef struct workqueue_lane_item {
+    void (*func)(int, void *);
+    void *arg;
+} workqueue_lane_item_t;
+
+typedef struct workqueue_lane {
+    pthread_mutex_t mutex;
+    workqueue_t *wq;
+    /* the slot of the worker it belongs to. */
+    unsigned int home;
+    workqueue_lane_item_t *items;
+    unsigned int head;
+    unsigned int count;
+    unsigned int size;
+    /* its item is queued or running. */
+    bool scheduled;
+} __cacheline_aligned workqueue_lane_t;
+
+typedef struct workqueue_lanes {
+    unsigned int n;
+    workqueue_lane_t *lane;
+} workqueue_lanes_t;
+
+static inline unsigned long long
+workqueue_key_hash(unsigned long long x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static workqueue_lanes_t *
+workqueue_lanes_get(workqueue_t *wq)
+{
+    workqueue_lanes_t *lanes, *expected = NULL;
+    unsigned int i;
+
+    lanes = wq_atomic_load(&wq->lanes);
+    if (lanes != NULL) {
+        return lanes;
+    }
+
+    lanes = malloc(sizeof(*lanes));
+    if (lanes == NULL) {
+        return NULL;
+    }
+    lanes->n = workqueue_max_workers(wq);
+    lanes->lane = wq_aligned_alloc(lanes->n * sizeof(workqueue_lane_t));
+    if (lanes->lane == NULL) {
+        free(lanes);
+        return NULL;
+    }
+    memset(lanes->lane, 0, lanes->n * sizeof(workqueue_lane_t));
+    for (i = 0; i < lanes->n; i++) {
+        workqueue_lane_t *lane = &lanes->lane[i];
+        pthread_mutex_init(&lane->mutex, NULL);
+        lane->wq = wq;
+        lane->home = i;
+    }
+
+    if (!wq_atomic_cas(&wq->lanes, &expected, lanes)) {
+        /* somebody beat us to it. */
+        for (i = 0; i < lanes->n; i++) {
+            pthread_mutex_destroy(&lanes->lane[i].mutex);
+        }
+        wq_aligned_free(lanes->lane);
+        free(lanes);
+        return expected;
+    }
+    return lanes;
+}
+
+static void workqueue_lane_run(int id, void *arg);
+
+static int
+workqueue_lane_schedule(workqueue_lane_t *lane)
+{
+    workqueue_t *wq = lane->wq;
+    work_item_t item;
+
+    if (wq->backend->push_worker != NULL) {
+        item.func = workqueue_lane_run;
+        item.arg = lane;
+        item.size = 0;
+        if (wq->backend->push_worker(wq, lane->home, &item) == 0) {
+            return 0;
+        }
+    }
+    return workqueue_submit(wq, workqueue_lane_run, lane);
+}
+
+static void
+workqueue_lane_run(int id, void *arg)
+{
+    workqueue_lane_t *lane = arg;
+    unsigned int n = 0;
+
+    pthread_mutex_lock(&lane->mutex);
+    while (lane->count > 0) {
+        workqueue_lane_item_t item = lane->items[lane->head];
+
+        lane->head = (lane->head + 1) % lane->size;
+        wq_atomic_store(&lane->count, lane->count - 1);
+        pthread_mutex_unlock(&lane->mutex);
+
+        item.func(id, item.arg);
+        workqueue_scratch_done();
+
+        if (++n == WORKQUEUE_LANE_BATCH &&
+            wq_atomic_load(&lane->count) > 0) {
+            /* still scheduled: whoever runs this next owns the lane. */
+            if (workqueue_lane_schedule(lane) == 0) {
+                return;
+            }
+            n = 0;
+        }
+        pthread_mutex_lock(&lane->mutex);
+    }
+    lane->scheduled = false;
+    pthread_mutex_unlock(&lane->mutex);
+}
+
+/* must be called with lane->mutex held. */
+static int
+workqueue_lane_push(workqueue_lane_t *lane, void (* func)(int, void *),
+                    void *arg)
+{
+    workqueue_lane_item_t *item;
+
+    if (lane->count == lane->size) {
+        unsigned int size = (lane->size) ? lane->size * 2 : 16, i;
+        workqueue_lane_item_t *items = malloc(size * sizeof(*items));
+
+        if (items == NULL) {
+            return -1;
+        }
+        for (i = 0; i < lane->count; i++) {
+            items[i] = lane->items[(lane->head + i) % lane->size];
+        }
+        free(lane->items);
+        lane->items = items;
+        lane->head = 0;
+        lane->size = size;
+    }
+    item = &lane->items[(lane->head + lane->count) % lane->size];
+    item->func = func;
+    item->arg = arg;
+    wq_atomic_store(&lane->count, lane->count + 1);
+
+    if (!lane->scheduled) {
+        /* the lane was empty, so this is its only item. */
+        if (workqueue_lane_schedule(lane) < 0) {
+            lane->count--;
+            return -1;
+        }
+        lane->scheduled = true;
+    }
+    return 0;
+}
+
+int
+workqueue_submit_keyed(workqueue_t *wq, unsigned long long key,
+                       void (* func)(int, void *), void *arg)
+{
+    workqueue_lanes_t *lanes;
+    workqueue_lane_t *lane;
+    unsigned long long h;
+    int rc;
+
+    if (wq == NULL || func == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!(wq->backend->flags & WORKQUEUE_BACKEND_SHARED_MEMORY)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    lanes = workqueue_lanes_get(wq);
+    if (lanes == NULL) {
+        return -1;
+    }
+
+    h = workqueue_key_hash(key);
+    lane = &lanes->lane[h % lanes->n];
+    if (wq_atomic_load_relaxed(&lane->count) > WORKQUEUE_LANE_HOT &&
+        lanes->n > 1) {
+        workqueue_lane_t *alt = &lanes->lane[(h >> 32) % lanes->n];
+        if (wq_atomic_load_relaxed(&alt->count) <
+            wq_atomic_load_relaxed(&lane->count)) {
+            lane = alt;
+        }
+    }
+
+    pthread_mutex_lock(&lane->mutex);
+    rc = workqueue_lane_push(lane, func, arg);
+    pthread_mutex_unlock(&lane->mutex);
+    return rc;
+}
+
+void
+workqueue_keyed_shutdown(workqueue_t *wq)
+{
+    workqueue_lanes_t *lanes = wq_atomic_exchange(&wq->lanes, NULL);
+    unsigned int i;
+
+    if (lanes == NULL) {
+        return;
+    }
+    for (i = 0; i < lanes->n; i++) {
+        /* the workers are gone, anything left was dropped with them. */
+        pthread_mutex_destroy(&lanes->lane[i].mutex);
+        free(lanes->lane[i].items);
+    }
+    wq_aligned_free(lanes->lane);
+    free(lanes);
+}
@@ -0,0 +1,316 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/time.h>
+
+#include <wq.h>
+
+#include "trace.h"
+#include "worker.h"
+#include "cpus.h"
+#include "manager.h"
+
+/* Worker spawning is done by a single, process-wide manager thread so
+   that submitters never pay for pthread_create() or fork().  A submit
+   that finds more queued items than available workers just puts the
+   queue on the manager's list.
+
+   The manager starts workers at once for a queue that has none.
+   Otherwise it gives the running workers WORKQUEUE_SPAWN_DELAY to catch
+   up, then starts up to 'budget' workers; the budget doubles for every
+   consecutive round the queue stays starved and drops back to one once
+   it keeps up, so a short burst does not spawn a full complement of
+   workers that will only time out again.  Idle workers still retire on
+   their own after wq->timeout seconds.
+
+   A forked child (a 'process' worker submitting work) has no manager
+   thread, so it starts workers itself. */
+#define WORKQUEUE_SPAWN_DELAY 1000      /* usecs */
+#define WORKQUEUE_SPAWN_BUDGET_MAX 16
+
+typedef struct workqueue_manager_queue {
+    workqueue_t *wq;
+    struct workqueue_manager_queue *next;
+    struct timeval since;
+    unsigned int budget;
+    bool listed;
+    bool busy;
+    bool again;
+    bool requested;
+} workqueue_manager_queue_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_cond_t done_cond;
+    pid_t pid;
+    workqueue_manager_queue_t *head;
+    workqueue_manager_queue_t **tail;
+} workqueue_manager = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static long
+workqueue_elapsed(const struct timeval *since, const struct timeval *now)
+{
+    return (now->tv_sec - since->tv_sec) * 1000000L +
+        (now->tv_usec - since->tv_usec);
+}
+
+/* Returns true if the queue should be looked at again shortly. */
+static bool
+workqueue_manager_service(workqueue_manager_queue_t *mq,
+                          const struct timeval *now)
+{
+    workqueue_t *wq = mq->wq;
+    workqueue_stat_t st;
+    unsigned int n, i, max;
+    int rc = 0;
+
+    if (wq->backend->manage != NULL) {
+        wq->backend->manage(wq);
+    }
+
+    workqueue_backend_stat(wq->backend, wq, &st);
+    max = workqueue_max_workers(wq) + st.blocked;
+
+    if (st.shutdown || st.queued <= st.available ||
+        st.current >= max) {
+        mq->budget = 1;
+        return false;
+    }
+
+    if (st.current > 0 &&
+        workqueue_elapsed(&mq->since, now) < WORKQUEUE_SPAWN_DELAY) {
+        return true;
+    }
+
+    n = st.queued - st.available;
+    if (n > max - st.current) {
+        n = max - st.current;
+    }
+    if (n > mq->budget) {
+        n = mq->budget;
+    }
+    for (i = 0; i < n; i++) {
+        rc = workqueue_worker_spawn(wq);
+        if (rc != 0) {
+            break;
+        }
+    }
+    TRACE("started %u workers (queued=%u current=%u)\n",
+          i, st.queued, st.current + i);
+
+    /* no room after all, e.g. in a pool shared with busier queues. */
+    if (i == 0 && rc == EAGAIN) {
+        mq->budget = 1;
+        return false;
+    }
+
+    if (mq->budget < WORKQUEUE_SPAWN_BUDGET_MAX) {
+        mq->budget *= 2;
+    }
+    mq->since = *now;
+    return true;
+}
+
+static void
+workqueue_manager_append(workqueue_manager_queue_t *mq)
+{
+    mq->next = NULL;
+    *workqueue_manager.tail = mq;
+    workqueue_manager.tail = &mq->next;
+    mq->listed = true;
+}
+
+static void *
+workqueue_manager_main(void *arg)
+{
+    pthread_mutex_lock(&workqueue_manager.mutex);
+    while (1) {
+        workqueue_manager_queue_t *list, *mq, *next;
+        struct timeval now;
+
+        if (workqueue_manager.head == NULL) {
+            pthread_cond_wait(&workqueue_manager.cond,
+                              &workqueue_manager.mutex);
+            continue;
+        }
+
+        list = workqueue_manager.head;
+        workqueue_manager.head = NULL;
+        workqueue_manager.tail = &workqueue_manager.head;
+        for (mq = list; mq != NULL; mq = mq->next) {
+            mq->listed = false;
+            mq->busy = true;
+        }
+        pthread_mutex_unlock(&workqueue_manager.mutex);
+
+        workqueue_cpus_update();
+        gettimeofday(&now, NULL);
+        for (mq = list; mq != NULL; mq = mq->next) {
+            mq->again = workqueue_manager_service(mq, &now);
+        }
+
+        pthread_mutex_lock(&workqueue_manager.mutex);
+        for (mq = list; mq != NULL; mq = next) {
+            next = mq->next;
+            mq->busy = false;
+            if (mq->again || mq->requested) {
+                workqueue_manager_append(mq);
+            }
+            mq->requested = false;
+        }
+        pthread_cond_broadcast(&workqueue_manager.done_cond);
+
+        if (workqueue_manager.head != NULL) {
+            struct timespec ts;
+            long usec;
+
+            gettimeofday(&now, NULL);
+            usec = now.tv_usec + WORKQUEUE_SPAWN_DELAY;
+            ts.tv_sec = now.tv_sec + usec / 1000000;
+            ts.tv_nsec = (usec % 1000000) * 1000;
+            pthread_cond_timedwait(&workqueue_manager.cond,
+                                   &workqueue_manager.mutex, &ts);
+        }
+    }
+    return NULL;
+}
+
+/* must be called with workqueue_manager.mutex held. */
+static int
+workqueue_manager_start(void)
+{
+    pthread_t t;
+    int rc;
+#ifndef __WIN32
+    sigset_t set, oldset;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+#endif
+    rc = pthread_create(&t, NULL, workqueue_manager_main, NULL);
+#ifndef __WIN32
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+#endif
+    if (rc != 0) {
+        WERROR("pthread_create() failed: %s\n", strerror(rc));
+        return rc;
+    }
+    pthread_detach(t);
+    __atomic_store_n(&workqueue_manager.pid, getpid(), __ATOMIC_RELEASE);
+    return 0;
+}
+
+void
+workqueue_manager_request(workqueue_t *wq)
+{
+    workqueue_manager_queue_t *mq = wq->manager;
+    pid_t pid = __atomic_load_n(&workqueue_manager.pid, __ATOMIC_ACQUIRE);
+    workqueue_stat_t st;
+
+    /* no more workers once the queue is shutting down. */
+    workqueue_backend_stat(wq->backend, wq, &st);
+    if (mq == NULL || st.shutdown) {
+        return;
+    }
+
+    /* in a forked worker the manager's mutex may have been copied in a
+       locked state, so don't touch it. */
+    if (pid != 0 && pid != getpid()) {
+        workqueue_worker_spawn(wq);
+        return;
+    }
+
+    pthread_mutex_lock(&workqueue_manager.mutex);
+    if (workqueue_manager.pid == 0 && workqueue_manager_start() != 0) {
+        pthread_mutex_unlock(&workqueue_manager.mutex);
+        workqueue_worker_spawn(wq);
+        return;
+    }
+    if (mq->busy) {
+        /* being serviced: its 'next' link is in use, relist it later. */
+        mq->requested = true;
+    } else if (!mq->listed) {
+        gettimeofday(&mq->since, NULL);
+        workqueue_manager_append(mq);
+        pthread_cond_signal(&workqueue_manager.cond);
+    }
+    pthread_mutex_unlock(&workqueue_manager.mutex);
+}
+
+int
+workqueue_manager_attach(workqueue_t *wq)
+{
+    workqueue_manager_queue_t *mq;
+
+    mq = calloc(1, sizeof(*mq));
+    if (mq == NULL) {
+        return -1;
+    }
+    mq->wq = wq;
+    mq->budget = 1;
+
+    pthread_mutex_lock(&workqueue_manager.mutex);
+    if (workqueue_manager.tail == NULL) {
+        workqueue_manager.tail = &workqueue_manager.head;
+    }
+    pthread_mutex_unlock(&workqueue_manager.mutex);
+
+    wq->manager = mq;
+    return 0;
+}
+
+void
+workqueue_manager_detach(workqueue_t *wq)
+{
+    workqueue_manager_queue_t *mq = wq->manager, **pp;
+
+    if (mq == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&workqueue_manager.mutex);
+    while (mq->busy) {
+        pthread_cond_wait(&workqueue_manager.done_cond,
+                          &workqueue_manager.mutex);
+    }
+    if (mq->listed) {
+        for (pp = &workqueue_manager.head; *pp != mq; pp = &(*pp)->next)
+            ;
+        *pp = mq->next;
+        if (workqueue_manager.tail == &mq->next) {
+            workqueue_manager.tail = pp;
+        }
+    }
+    pthread_mutex_unlock(&workqueue_manager.mutex);
+
+    wq->manager = NULL;
+    free(mq);
+}
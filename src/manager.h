@@ -0,0 +1,34 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#ifndef __MANAGER_H__
+#define __MANAGER_H__
+
+/* Internal interface to the worker manager, see manager.c. */
+
+int workqueue_manager_attach(workqueue_t *wq);
+void workqueue_manager_detach(workqueue_t *wq);
+/* called, without the lock held, when a queue has more items queued
+   than available workers. */
+void workqueue_manager_request(workqueue_t *wq);
+
+/* starts one worker for 'wq', defined in wq.c. */
+int workqueue_worker_spawn(workqueue_t *wq);
+
+#endif /* __MANAGER_H__ */
@@ -0,0 +1,484 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <wq.h>
+
+#include "atomic.h"
+#include "trace.h"
+
+extern int wq_monotime(struct timespec *tp);
+
+/* Named queues.  The creating process maps a ring of fixed size slots
+   with shm_open(); any process that opens the name claims a slot with
+   a compare-and-swap on 'tail' once the slot's sequence number says it
+   is free for that position (a bounded MPMC queue as described by
+   D. Vyukov, with a single consumer), copies its data in and publishes
+   it through the slot's 'claim'.  The consumer is a thread of
+   the creator that hands every slot to 'wq' with
+   workqueue_submit_inline(), so whatever backend the queue uses runs
+   the items.
+
+   Producers make no system call unless that thread is asleep: it
+   raises 'sleeping' before it looks at the ring a last time, and a
+   producer that sees it bumps 'wake' and wakes it.
+
+   A producer may die between claiming a slot and publishing it, which
+   would stall the consumer on that slot for good.  So once it has
+   claimed a slot, a producer marks it with its pid in 'claim', tagged
+   with the position the slot was claimed for; a slot left claimed for
+   WORKQUEUE_NAMED_STALE is given up by the consumer if it was never
+   marked or if kill() says its producer is gone (the item is then
+   counted as lost, see workqueue_named_stat()).  Only the consumer
+   ever moves 'seq', and every change of 'claim' is a compare-and-swap
+   against the exact position and pid, so a producer that was given up
+   while still alive (stalled, or in another pid namespace) fails to
+   publish into the recycled slot and just submits again. */
+#define WORKQUEUE_NAMED_MAGIC 0x77716e33        /* "wqn3" */
+#define WORKQUEUE_NAMED_SLOTS 1024
+#define WORKQUEUE_NAMED_STALE 1000000000L       /* nsecs */
+#define WORKQUEUE_NAMED_READY 0xfffffffeULL
+#define WORKQUEUE_NAMED_GIVEN_UP 0xffffffffULL
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static void
+workqueue_named_sleep(unsigned int *word, unsigned int val)
+{
+    struct timespec ts = { 1, 0 };
+    syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void
+workqueue_named_wake(unsigned int *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+#else
+/* no futex: the consumer polls. */
+static void
+workqueue_named_sleep(unsigned int *word, unsigned int val)
+{
+    usleep(1000);
+}
+
+static void
+workqueue_named_wake(unsigned int *word)
+{
+}
+#endif
+
+typedef struct workqueue_named_slot {
+    unsigned int seq;
+    unsigned int size;
+    /* position << 32 | the pid of the producer writing it, if any, or
+       WORKQUEUE_NAMED_READY once it is published. */
+    unsigned long long claim;
+    union {
+        char data[WORKQUEUE_INLINE_MAX];
+        long long align_ll;
+    } u;
+} workqueue_named_slot_t;
+
+typedef struct workqueue_named_ring {
+    unsigned int magic;         /* set once the ring is ready */
+    unsigned int slots;         /* a power of 2 */
+    unsigned int tail __cacheline_aligned;
+    unsigned int head __cacheline_aligned;
+    unsigned int sleeping;
+    unsigned int wake;
+    /* see workqueue_named_stat(). */
+    unsigned int dropped;
+    unsigned int lost;
+    workqueue_named_slot_t slot[] __cacheline_aligned;
+} workqueue_named_ring_t;
+
+struct workqueue_named {
+    workqueue_named_ring_t *ring;
+    size_t size;
+    pid_t pid;
+    /* the creator's only. */
+    workqueue_t *wq;
+    void (*func)(int, void *);
+    char *name;
+    pthread_t thread;
+    bool shutdown;
+};
+
+static inline size_t
+workqueue_named_size(unsigned int slots)
+{
+    return sizeof(workqueue_named_ring_t) +
+        slots * sizeof(workqueue_named_slot_t);
+}
+
+/* Frees the slot at 'pos' for its next round. */
+static void
+workqueue_named_recycle(workqueue_named_ring_t *ring,
+                        workqueue_named_slot_t *slot, unsigned int pos)
+{
+    wq_atomic_store(&slot->claim,
+                    (unsigned long long)(pos + ring->slots) << 32);
+    wq_atomic_store(&slot->seq, pos + ring->slots);
+}
+
+/* Whether the slot claimed at 'pos' but still unpublished can be given
+   up on. */
+static bool
+workqueue_named_reclaim(workqueue_named_ring_t *ring,
+                        workqueue_named_slot_t *slot, unsigned int pos)
+{
+    unsigned long long given_up = (unsigned long long)pos << 32 |
+        WORKQUEUE_NAMED_GIVEN_UP;
+    unsigned long long expected = (unsigned long long)pos << 32;
+    pid_t pid;
+
+    if (wq_atomic_cas(&slot->claim, &expected, given_up)) {
+        return true;
+    }
+    /* published meanwhile. */
+    if ((expected & 0xffffffff) == WORKQUEUE_NAMED_READY) {
+        return false;
+    }
+    pid = (pid_t)(expected & 0xffffffff);
+    if (kill(pid, 0) == 0 || errno != ESRCH) {
+        return false;
+    }
+    /* counted first: should the producer turn up after all, it takes
+       this back. */
+    wq_atomic_add_fetch(&ring->lost, 1);
+    if (!wq_atomic_cas(&slot->claim, &expected, given_up)) {
+        /* published after all. */
+        wq_atomic_sub_fetch(&ring->lost, 1);
+        return false;
+    }
+    WERROR("producer %d died submitting an item\n", (int)pid);
+    return true;
+}
+
+static void *
+workqueue_named_main(void *arg)
+{
+    workqueue_named_t *q = arg;
+    workqueue_named_ring_t *ring = q->ring;
+    unsigned int mask = ring->slots - 1, head = ring->head, wake;
+    struct timespec since;
+    bool stalled = false;
+
+    while (1) {
+        workqueue_named_slot_t *slot = &ring->slot[head & mask];
+        unsigned long long ready = (unsigned long long)head << 32 |
+            WORKQUEUE_NAMED_READY;
+
+        if (wq_atomic_load(&slot->claim) == ready) {
+            if (workqueue_submit_inline(q->wq, q->func, slot->u.data,
+                                        slot->size) != 0) {
+                WERROR("workqueue_submit_inline() failed: %s\n",
+                       strerror(errno));
+                wq_atomic_add_fetch(&ring->dropped, 1);
+            }
+            workqueue_named_recycle(ring, slot, head);
+            head++;
+            wq_atomic_store_relaxed(&ring->head, head);
+            stalled = false;
+            continue;
+        }
+
+        /* claimed, but not published yet. */
+        if (wq_atomic_load(&ring->tail) != head) {
+            struct timespec now;
+
+            wq_monotime(&now);
+            if (!stalled) {
+                stalled = true;
+                since = now;
+            } else if ((now.tv_sec - since.tv_sec) * 1000000000L +
+                       (now.tv_nsec - since.tv_nsec) >=
+                       WORKQUEUE_NAMED_STALE &&
+                       workqueue_named_reclaim(ring, slot, head)) {
+                workqueue_named_recycle(ring, slot, head);
+                head++;
+                wq_atomic_store_relaxed(&ring->head, head);
+                stalled = false;
+                continue;
+            }
+        }
+        if (wq_atomic_load(&q->shutdown)) {
+            break;
+        }
+
+        wake = wq_atomic_load(&ring->wake);
+        __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->claim, __ATOMIC_SEQ_CST) != ready &&
+            !wq_atomic_load(&q->shutdown)) {
+            workqueue_named_sleep(&ring->wake, wake);
+        }
+        wq_atomic_store_relaxed(&ring->sleeping, 0);
+    }
+    return NULL;
+}
+
+workqueue_named_t *
+workqueue_named_create(workqueue_t *wq, const char *name,
+                       unsigned int slots, void (* func)(int, void *))
+{
+    workqueue_named_t *q;
+    workqueue_named_ring_t *ring;
+    unsigned int n, i;
+    sigset_t set, oldset;
+    int fd, rc;
+
+    if (wq == NULL || name == NULL || func == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (slots == 0) {
+        slots = WORKQUEUE_NAMED_SLOTS;
+    }
+    for (n = 1; n < slots; n <<= 1)
+        ;
+
+    q = calloc(1, sizeof(*q));
+    if (q == NULL) {
+        return NULL;
+    }
+    q->wq = wq;
+    q->func = func;
+    q->pid = getpid();
+    q->size = workqueue_named_size(n);
+    q->name = strdup(name);
+    if (q->name == NULL) {
+        free(q);
+        return NULL;
+    }
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        goto fail;
+    }
+    if (ftruncate(fd, q->size) < 0) {
+        goto fail_unlink;
+    }
+    ring = mmap(NULL, q->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        goto fail_unlink;
+    }
+    close(fd);
+    fd = -1;
+
+    ring->slots = n;
+    for (i = 0; i < n; i++) {
+        ring->slot[i].seq = i;
+        ring->slot[i].claim = (unsigned long long)i << 32;
+    }
+    wq_atomic_store(&ring->magic, WORKQUEUE_NAMED_MAGIC);
+    q->ring = ring;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    rc = pthread_create(&q->thread, NULL, workqueue_named_main, q);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (rc != 0) {
+        munmap(ring, q->size);
+        errno = rc;
+        goto fail_unlink;
+    }
+    return q;
+
+fail_unlink:
+    rc = errno;
+    if (fd >= 0) {
+        close(fd);
+    }
+    shm_unlink(name);
+    errno = rc;
+fail:
+    free(q->name);
+    free(q);
+    return NULL;
+}
+
+void
+workqueue_named_destroy(workqueue_named_t *q)
+{
+    if (q == NULL) {
+        return;
+    }
+    shm_unlink(q->name);
+    wq_atomic_store(&q->shutdown, true);
+    wq_atomic_add_fetch(&q->ring->wake, 1);
+    workqueue_named_wake(&q->ring->wake);
+    pthread_join(q->thread, NULL);
+
+    munmap(q->ring, q->size);
+    free(q->name);
+    free(q);
+}
+
+workqueue_named_t *
+workqueue_named_open(const char *name)
+{
+    workqueue_named_t *q;
+    workqueue_named_ring_t *ring;
+    struct stat st;
+    int fd;
+
+    if (name == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    /* still being set up by its creator. */
+    if ((size_t)st.st_size < sizeof(workqueue_named_ring_t)) {
+        close(fd);
+        errno = EAGAIN;
+        return NULL;
+    }
+    ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        return NULL;
+    }
+    if (wq_atomic_load(&ring->magic) != WORKQUEUE_NAMED_MAGIC ||
+        workqueue_named_size(ring->slots) != (size_t)st.st_size) {
+        munmap(ring, st.st_size);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    q = calloc(1, sizeof(*q));
+    if (q == NULL) {
+        munmap(ring, st.st_size);
+        return NULL;
+    }
+    q->ring = ring;
+    q->size = st.st_size;
+    q->pid = getpid();
+    return q;
+}
+
+void
+workqueue_named_close(workqueue_named_t *q)
+{
+    if (q == NULL) {
+        return;
+    }
+    munmap(q->ring, q->size);
+    free(q);
+}
+
+int
+workqueue_named_submit(workqueue_named_t *q, const void *data, size_t size)
+{
+    workqueue_named_ring_t *ring;
+    workqueue_named_slot_t *slot;
+    unsigned long long claim, claim_pos;
+    unsigned int pos, seq;
+
+    if (q == NULL || (data == NULL && size > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (size > WORKQUEUE_INLINE_MAX) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    ring = q->ring;
+again:
+    pos = wq_atomic_load_relaxed(&ring->tail);
+    while (1) {
+        slot = &ring->slot[pos & (ring->slots - 1)];
+        seq = wq_atomic_load(&slot->seq);
+        if (seq == pos) {
+            if (!wq_atomic_cas(&ring->tail, &pos, pos + 1)) {
+                continue;
+            }
+            /* unless the consumer has given up on us meanwhile. */
+            claim_pos = (unsigned long long)pos << 32;
+            claim = claim_pos;
+            if (wq_atomic_cas(&slot->claim, &claim,
+                              claim_pos | (unsigned int)q->pid)) {
+                claim = claim_pos | (unsigned int)q->pid;
+                break;
+            }
+            pos = wq_atomic_load_relaxed(&ring->tail);
+        } else if ((int)(seq - pos) < 0) {
+            errno = EAGAIN;
+            return -1;
+        } else {
+            pos = wq_atomic_load_relaxed(&ring->tail);
+        }
+    }
+
+    slot->size = size;
+    if (size > 0) {
+        memcpy(slot->u.data, data, size);
+    }
+    /* the consumer took us for dead and recycled the slot: it counted
+       the item as lost, but it goes in again instead. */
+    if (!__atomic_compare_exchange_n(&slot->claim, &claim,
+                                     claim_pos | WORKQUEUE_NAMED_READY,
+                                     false, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_SEQ_CST)) {
+        wq_atomic_sub_fetch(&ring->lost, 1);
+        goto again;
+    }
+
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST)) {
+        wq_atomic_add_fetch(&ring->wake, 1);
+        workqueue_named_wake(&ring->wake);
+    }
+    return 0;
+}
+
+int
+workqueue_named_stat(workqueue_named_t *q, workqueue_named_stat_t *st)
+{
+    workqueue_named_ring_t *ring;
+
+    if (q == NULL || st == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    ring = q->ring;
+    st->queued = wq_atomic_load(&ring->tail) - wq_atomic_load(&ring->head);
+    st->dropped = wq_atomic_load(&ring->dropped);
+    st->lost = wq_atomic_load(&ring->lost);
+    return 0;
+}
@@ -0,0 +1,270 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <wq.h>
+
+#include "atomic.h"
+#include "fiber.h"
+#include "scratch.h"
+
+/* Chunks are handed out from a shared cursor rather than by recursively
+   submitting halves of the range: every submit costs the queue lock and
+   a pipe write, while claiming a chunk is a single atomic add.  The
+   calling thread participates and at most one helper item per worker is
+   submitted; helpers that start after the range is exhausted return
+   immediately, so nested use from inside a work function can't
+   deadlock. */
+typedef struct workqueue_range {
+    long cursor __cacheline_aligned;
+    long done __cacheline_aligned;
+    long begin;
+    long end;
+    long grain;
+    long nchunks;
+    unsigned int refs;
+    unsigned int nslots;
+
+    void (*body)(void *, long, long);
+    void (*reduce_body)(void *, long, long, void *);
+    void *ctx;
+    const void *identity;
+    size_t size;
+    size_t stride;
+    char *accs;
+    bool *used;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool finished;
+    /* fibers parked waiting for 'finished'. */
+    struct workqueue_fiber *fibers;
+} workqueue_range_t;
+
+static void
+workqueue_range_release(workqueue_range_t *r)
+{
+    if (wq_atomic_sub_fetch(&r->refs, 1) == 0) {
+        pthread_mutex_destroy(&r->mutex);
+        pthread_cond_destroy(&r->cond);
+        free(r->used);
+        wq_aligned_free(r);
+    }
+}
+
+/* 'reset' is false for the calling thread: its own scratch memory must
+   survive. */
+static void
+workqueue_range_run(workqueue_range_t *r, unsigned int slot, bool reset)
+{
+    long b, n = 0;
+    void *acc = NULL;
+
+    while ((b = wq_atomic_fetch_add(&r->cursor, r->grain)) < r->end) {
+        long e = (r->end - b > r->grain) ? b + r->grain : r->end;
+
+        if (r->reduce_body != NULL) {
+            if (acc == NULL) {
+                acc = r->accs + (slot * r->stride);
+                memcpy(acc, r->identity, r->size);
+                r->used[slot] = true;
+            }
+            r->reduce_body(r->ctx, b, e, acc);
+        } else {
+            r->body(r->ctx, b, e);
+        }
+        if (reset) {
+            workqueue_scratch_done();
+        }
+        n++;
+    }
+
+    if (n > 0 && wq_atomic_add_fetch(&r->done, n) == r->nchunks) {
+        struct workqueue_fiber *fibers;
+
+        pthread_mutex_lock(&r->mutex);
+        r->finished = true;
+        pthread_cond_broadcast(&r->cond);
+        fibers = r->fibers;
+        r->fibers = NULL;
+        pthread_mutex_unlock(&r->mutex);
+        workqueue_fiber_wake_all(fibers);
+    }
+}
+
+static void
+workqueue_range_helper(int id, void *arg)
+{
+    workqueue_range_t *r = arg;
+    workqueue_range_run(r, wq_atomic_fetch_add(&r->nslots, 1), true);
+    workqueue_range_release(r);
+}
+
+static int
+workqueue_range_execute(workqueue_t *wq, long begin, long end, long grain,
+                        void (*body)(void *, long, long),
+                        void (*reduce_body)(void *, long, long, void *),
+                        void (*combine)(void *, void *, const void *),
+                        void *ctx, void *result, const void *identity,
+                        size_t size)
+{
+    workqueue_range_t *r;
+    unsigned long helpers = 0, i;
+    long nchunks, n;
+
+    if (wq == NULL || end < begin) {
+        errno = EINVAL;
+        return -1;
+    }
+    n = end - begin;
+    if (n == 0) {
+        return 0;
+    }
+
+    if (wq->backend->flags & WORKQUEUE_BACKEND_SHARED_MEMORY) {
+        helpers = workqueue_max_workers(wq);
+    }
+    if (grain <= 0) {
+        /* a few chunks per participant evens out imbalance. */
+        grain = n / (long)(4 * (helpers + 1));
+        if (grain < 1) {
+            grain = 1;
+        }
+    }
+    nchunks = (n + grain - 1) / grain;
+    if ((unsigned long)(nchunks - 1) < helpers) {
+        helpers = nchunks - 1;
+    }
+
+    /* nothing to share: run it here. */
+    if (helpers == 0) {
+        if (reduce_body != NULL) {
+            for (; begin < end; begin += grain) {
+                long e = (end - begin > grain) ? begin + grain : end;
+                reduce_body(ctx, begin, e, result);
+            }
+        } else {
+            for (; begin < end; begin += grain) {
+                long e = (end - begin > grain) ? begin + grain : end;
+                body(ctx, begin, e);
+            }
+        }
+        return 0;
+    }
+
+    r = wq_aligned_alloc(sizeof(*r));
+    if (r == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(r, 0, sizeof(*r));
+    r->cursor = begin;
+    r->begin = begin;
+    r->end = end;
+    r->grain = grain;
+    r->nchunks = nchunks;
+    r->refs = helpers + 1;
+    r->nslots = 1;
+    r->body = body;
+    r->reduce_body = reduce_body;
+    r->ctx = ctx;
+
+    if (reduce_body != NULL) {
+        /* one accumulator per participant, each on its own cache line. */
+        r->size = size;
+        r->stride = (size + CACHELINE_SIZE - 1) & ~(CACHELINE_SIZE - 1);
+        r->identity = identity;
+        r->used = calloc(helpers + 1, sizeof(bool));
+        r->accs = wq_aligned_alloc(r->stride * (helpers + 1));
+        if (r->used == NULL || r->accs == NULL) {
+            free(r->used);
+            wq_aligned_free(r->accs);
+            wq_aligned_free(r);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    for (i = 0; i < helpers; i++) {
+        if (workqueue_submit(wq, workqueue_range_helper, r) < 0) {
+            /* the caller picks up the slack. */
+            break;
+        }
+    }
+    for (; i < helpers; i++) {
+        wq_atomic_sub_fetch(&r->refs, 1);
+    }
+
+    workqueue_range_run(r, 0, false);
+
+    pthread_mutex_lock(&r->mutex);
+    while (!r->finished && wq_atomic_load(&r->done) < r->nchunks) {
+        workqueue_fiber_cond_wait(&r->cond, &r->mutex, &r->fibers);
+    }
+    pthread_mutex_unlock(&r->mutex);
+
+    if (reduce_body != NULL) {
+        for (i = 0; i <= helpers; i++) {
+            if (r->used[i]) {
+                combine(ctx, result, r->accs + (i * r->stride));
+            }
+        }
+        wq_aligned_free(r->accs);
+        r->accs = NULL;
+    }
+
+    workqueue_range_release(r);
+    return 0;
+}
+
+int
+workqueue_parallel_for(workqueue_t *wq, long begin, long end, long grain,
+                       void (* body)(void *ctx, long b, long e), void *ctx)
+{
+    if (body == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return workqueue_range_execute(wq, begin, end, grain, body,
+                                   NULL, NULL, ctx, NULL, NULL, 0);
+}
+
+int
+workqueue_parallel_reduce(workqueue_t *wq, long begin, long end, long grain,
+                          void (* body)(void *ctx, long b, long e,
+                                        void *acc),
+                          void (* combine)(void *ctx, void *result,
+                                           const void *acc),
+                          void *ctx, void *result, const void *identity,
+                          size_t size)
+{
+    if (body == NULL || combine == NULL || result == NULL ||
+        identity == NULL || size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return workqueue_range_execute(wq, begin, end, grain, NULL, body,
+                                   combine, ctx, result, identity, size);
+}
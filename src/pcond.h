@@ -0,0 +1,144 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#ifndef __PCOND_H__
+#define __PCOND_H__
+
+/* Condition variables shared between processes.
+
+   A process that dies while waiting on a process-shared pthread_cond_t
+   is never accounted for, and a later signal or broadcast may wait for
+   it forever.  On Linux this is instead a bare sequence number: waiters
+   sleep on it with futex(2), so a dead one leaves nothing behind.  The
+   waits are like pthread_cond_wait()'s: callers must recheck their
+   condition. */
+
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "atomic.h"
+
+typedef struct workqueue_pcond {
+    unsigned int seq;
+} workqueue_pcond_t;
+
+static inline void
+workqueue_pcond_init(workqueue_pcond_t *c)
+{
+    c->seq = 0;
+}
+
+static inline void
+workqueue_pcond_signal(workqueue_pcond_t *c)
+{
+    wq_atomic_add_fetch(&c->seq, 1);
+    syscall(SYS_futex, &c->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static inline void
+workqueue_pcond_broadcast(workqueue_pcond_t *c)
+{
+    wq_atomic_add_fetch(&c->seq, 1);
+    syscall(SYS_futex, &c->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* called with 'mutex' held, which must be robust; 0 waits forever. */
+static inline int
+workqueue_pcond_wait(workqueue_pcond_t *c, pthread_mutex_t *mutex,
+                     unsigned int timeout)
+{
+    unsigned int seq = wq_atomic_load(&c->seq);
+    struct timespec ts = { timeout, 0 };
+    int rc = 0;
+
+    pthread_mutex_unlock(mutex);
+    if (syscall(SYS_futex, &c->seq, FUTEX_WAIT, seq,
+                timeout ? &ts : NULL, NULL, 0) < 0 && errno == ETIMEDOUT) {
+        rc = ETIMEDOUT;
+    }
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+        pthread_mutex_consistent(mutex);
+    }
+    return rc;
+}
+
+#else
+
+typedef struct workqueue_pcond {
+    pthread_cond_t cond;
+} workqueue_pcond_t;
+
+extern int wq_gettime(struct timespec *tp);
+
+static inline void
+workqueue_pcond_init(workqueue_pcond_t *c)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&c->cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static inline void
+workqueue_pcond_signal(workqueue_pcond_t *c)
+{
+    pthread_cond_signal(&c->cond);
+}
+
+static inline void
+workqueue_pcond_broadcast(workqueue_pcond_t *c)
+{
+    pthread_cond_broadcast(&c->cond);
+}
+
+static inline int
+workqueue_pcond_wait(workqueue_pcond_t *c, pthread_mutex_t *mutex,
+                     unsigned int timeout)
+{
+    int rc;
+
+    if (timeout) {
+        struct timespec ts;
+        wq_gettime(&ts);
+        ts.tv_sec += timeout;
+        rc = pthread_cond_timedwait(&c->cond, mutex, &ts);
+    } else {
+        rc = pthread_cond_wait(&c->cond, mutex);
+    }
+#ifdef EOWNERDEAD
+    if (rc == EOWNERDEAD) {
+        pthread_mutex_consistent(mutex);
+        rc = 0;
+    }
+#endif
+    return rc;
+}
+
+#endif
+
+#endif /* __PCOND_H__ */
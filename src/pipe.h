@@ -116,7 +116,7 @@ pipe_set_nonblocking(PIPE p)
 
 #else /* __WIN32 */
 
-static int
+static inline int
 pipe_set_nonblocking(PIPE p)
 {
     int flags, rc;
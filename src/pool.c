@@ -0,0 +1,663 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/time.h>
+
+#include <wq.h>
+
+#include "counters.h"
+#include "cpus.h"
+#include "attr.h"
+#include "scratch.h"
+#include "hooks.h"
+#include "manager.h"
+
+/* Shared worker pools.  A queue created with workqueue_init_pool() has
+   no pipe and no workers of its own: workqueue_submit() appends the item
+   to the queue's ring and the pool's workers pick items from the queues
+   that have any, in deficit round robin order.  A queue with weight w
+   gets w items in a row each time its turn comes up, so under load the
+   queues share the workers in proportion to their weights.
+
+   The "nofd" backend is a queue with a private pool of its own: it
+   behaves like a "thread" queue, but without the pipe.
+
+   pool->mutex and a queue's own mutex are never held together. */
+
+typedef struct workqueue_pool_queue {
+    workqueue_counters_t c;             /* current is the running count */
+    pthread_mutex_t mutex;
+    pthread_cond_t completion_cond;
+    workqueue_pool_t *pool;
+    /* the rest is protected by pool->mutex. */
+    struct workqueue_pool_queue *next;  /* in the pool's active list */
+    work_item_t *items;
+    unsigned int head;
+    unsigned int count;
+    unsigned int size;
+    unsigned int weight;
+    unsigned int deficit;
+    unsigned int running;
+    bool active;
+    bool shutdown;
+} workqueue_pool_queue_t;
+
+struct workqueue_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    /* signalled when a worker exits or finishes an item of a queue
+       being shut down. */
+    pthread_cond_t done_cond;
+    workqueue_pool_queue_t *head;
+    workqueue_pool_queue_t **tail;
+    unsigned int max_workers;           /* 0 follows workqueue_cpus() */
+    unsigned int current;
+    unsigned int sleepers;
+    /* workers in a workqueue_blocking_begin/end() region. */
+    unsigned int blocked;
+    unsigned int queues;
+    unsigned int timeout;
+    size_t stack_size;
+    size_t guard_size;
+    /* the queue owning a private pool, whose settings apply. */
+    workqueue_t *owner;
+    int n;
+    bool shutdown;
+};
+
+extern const workqueue_backend_t workqueue_pool_backend;
+
+static __thread int workqueue_pool_worker_id;
+
+static unsigned int
+workqueue_pool_max_workers(workqueue_pool_t *pool)
+{
+    if (pool->owner != NULL) {
+        return workqueue_max_workers(pool->owner);
+    }
+    return (pool->max_workers > 0) ? pool->max_workers : workqueue_cpus();
+}
+
+/* must be called with pool->mutex held. */
+static void
+workqueue_pool_unlink(workqueue_pool_t *pool, workqueue_pool_queue_t *q)
+{
+    workqueue_pool_queue_t **pp;
+
+    for (pp = &pool->head; *pp != q; pp = &(*pp)->next)
+        ;
+    *pp = q->next;
+    if (pool->tail == &q->next) {
+        pool->tail = pp;
+    }
+    q->next = NULL;
+    q->active = false;
+}
+
+/* must be called with pool->mutex held. */
+static void
+workqueue_pool_append(workqueue_pool_t *pool, workqueue_pool_queue_t *q)
+{
+    q->next = NULL;
+    q->deficit = q->weight;
+    q->active = true;
+    *pool->tail = q;
+    pool->tail = &q->next;
+}
+
+/* Takes the next item in DRR order, must be called with pool->mutex
+   held and a non-empty active list. */
+static workqueue_pool_queue_t *
+workqueue_pool_take(workqueue_pool_t *pool, work_item_t *item)
+{
+    workqueue_pool_queue_t *q = pool->head;
+
+    *item = q->items[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    q->running++;
+    /* running goes up before queued goes down so the queue never looks
+       idle in between. */
+    wq_atomic_add_fetch(&q->c.current, 1);
+    wq_atomic_sub_fetch(&q->c.queued, 1);
+
+    if (q->count == 0) {
+        workqueue_pool_unlink(pool, q);
+    } else if (--q->deficit == 0) {
+        /* used up its quantum, go to the back of the line. */
+        workqueue_pool_unlink(pool, q);
+        workqueue_pool_append(pool, q);
+    }
+    return q;
+}
+
+/* wakes workqueue_wait() callers if there may be any. */
+static void
+workqueue_pool_complete(workqueue_pool_queue_t *q)
+{
+    if (workqueue_counters_contended(&q->c, &q->c.waiters)) {
+        workqueue_counters_lock(&q->c, &q->mutex);
+        pthread_cond_broadcast(&q->completion_cond);
+        workqueue_counters_unlock(&q->c, &q->mutex);
+    }
+}
+
+static void *
+workqueue_pool_worker(void *arg)
+{
+    workqueue_pool_t *pool = arg;
+    /* only private pools run the hooks of their queue. */
+    workqueue_t *owner = pool->owner;
+    int rc = 0;
+
+    if (owner != NULL) {
+        workqueue_hooks_start(owner);
+    }
+    pthread_mutex_lock(&pool->mutex);
+    workqueue_pool_worker_id = ++pool->n;
+
+    while (1) {
+        workqueue_pool_queue_t *q;
+        work_item_t item;
+
+        if (pool->head == NULL) {
+            unsigned int timeout = (pool->owner != NULL) ?
+                pool->owner->timeout : pool->timeout;
+
+            if (pool->shutdown || rc == ETIMEDOUT) {
+                if (owner == NULL || owner->worker_fini == NULL) {
+                    break;
+                }
+                /* as in workqueue_worker_main(), the stop hook runs
+                   unlocked and an item may come in meanwhile. */
+                pthread_mutex_unlock(&pool->mutex);
+                workqueue_hooks_stop(owner);
+                pthread_mutex_lock(&pool->mutex);
+                if (pool->shutdown || pool->head == NULL) {
+                    break;
+                }
+                pthread_mutex_unlock(&pool->mutex);
+                workqueue_hooks_start(owner);
+                pthread_mutex_lock(&pool->mutex);
+                rc = 0;
+                continue;
+            }
+            /* going idle anyway, a good time to follow quota changes. */
+            workqueue_cpus_update();
+            pool->sleepers++;
+            if (timeout) {
+                struct timeval now;
+                struct timespec ts;
+
+                gettimeofday(&now, NULL);
+                ts.tv_sec = now.tv_sec + timeout;
+                ts.tv_nsec = now.tv_usec * 1000;
+                rc = pthread_cond_timedwait(&pool->work_cond, &pool->mutex,
+                                            &ts);
+            } else {
+                /* 0 waits for work forever, as in the other backends. */
+                rc = pthread_cond_wait(&pool->work_cond, &pool->mutex);
+            }
+            pool->sleepers--;
+            continue;
+        }
+        rc = 0;
+
+        q = workqueue_pool_take(pool, &item);
+        pthread_mutex_unlock(&pool->mutex);
+
+        item.func(workqueue_pool_worker_id,
+                  (item.size > 0) ? item.u.data : item.arg);
+        workqueue_scratch_done();
+
+        __atomic_sub_fetch(&q->c.current, 1, __ATOMIC_SEQ_CST);
+        workqueue_pool_complete(q);
+
+        /* the last access to 'q': shutdown waits for running == 0. */
+        pthread_mutex_lock(&pool->mutex);
+        if (--q->running == 0 && q->shutdown) {
+            pthread_cond_broadcast(&pool->done_cond);
+        }
+
+        /* one too many once a blocking region ended. */
+        if (pool->current >
+            workqueue_pool_max_workers(pool) + pool->blocked) {
+            if (owner != NULL && owner->worker_fini != NULL) {
+                pthread_mutex_unlock(&pool->mutex);
+                workqueue_hooks_stop(owner);
+                pthread_mutex_lock(&pool->mutex);
+            }
+            break;
+        }
+    }
+
+    workqueue_hooks_clear();
+    pool->current--;
+    pthread_cond_broadcast(&pool->done_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/* must be called with pool->mutex held, returns with it held. */
+static int
+workqueue_pool_spawn(workqueue_pool_t *pool)
+{
+    pthread_t t;
+    pthread_attr_t attr;
+    int rc;
+#ifndef __WIN32
+    sigset_t set, oldset;
+#endif
+
+    pool->current++;
+    if (pool->owner != NULL) {
+        workqueue_attr_init(&attr, pool->owner->stack_size,
+                            pool->owner->guard_size);
+    } else {
+        workqueue_attr_init(&attr, pool->stack_size, pool->guard_size);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+#ifndef __WIN32
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+#endif
+    rc = pthread_create(&t, &attr, workqueue_pool_worker, pool);
+#ifndef __WIN32
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+#endif
+    pthread_attr_destroy(&attr);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (rc == 0) {
+        pthread_detach(t);
+    } else {
+        /* the item stays queued for the workers that do exist. */
+        pool->current--;
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    return rc;
+}
+
+/* Pool workers are started by the manager too, on behalf of whichever
+   queue asked; they serve the whole pool, so 'func' is not used. */
+static int
+workqueue_pool_worker_create(workqueue_t *wq, void *(*func)(void *))
+{
+    workqueue_pool_queue_t *q = wq->priv;
+    workqueue_pool_t *pool = q->pool;
+    int rc = EAGAIN;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (!pool->shutdown && pool->head != NULL && pool->sleepers == 0 &&
+        pool->current < workqueue_pool_max_workers(pool) + pool->blocked) {
+        rc = workqueue_pool_spawn(pool);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return rc;
+}
+
+workqueue_pool_t *
+workqueue_pool_create(unsigned int max_workers)
+{
+    workqueue_pool_t *pool;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->tail = &pool->head;
+    pool->max_workers = max_workers;
+    pool->timeout = WORKQUEUE_DEFAULT_TIMEOUT;
+    return pool;
+}
+
+void
+workqueue_pool_destroy(workqueue_pool_t *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    assert(pool->queues == 0);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    while (pool->current > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+void
+workqueue_pool_set_stack(workqueue_pool_t *pool, size_t stack_size,
+                         size_t guard_size)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->stack_size = stack_size;
+    pool->guard_size = guard_size;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static int
+workqueue_pool_queue_init(workqueue_t *wq, workqueue_pool_t *pool,
+                          unsigned int weight)
+{
+    workqueue_pool_queue_t *q;
+
+    q = wq_aligned_alloc(sizeof(*q));
+    if (q == NULL) {
+        return -1;
+    }
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->completion_cond, NULL);
+    q->pool = pool;
+    q->weight = (weight > 0) ? weight : 1;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->queues++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    wq->priv = q;
+    return 0;
+}
+
+int
+workqueue_init_pool(workqueue_t *wq, workqueue_pool_t *pool,
+                    unsigned int weight)
+{
+    if (wq == NULL || pool == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(wq, 0, sizeof(workqueue_t));
+    wq->backend = &workqueue_pool_backend;
+    wq->max_workers = pool->max_workers;
+    wq->timeout = pool->timeout;
+    if (workqueue_manager_attach(wq) < 0) {
+        return -1;
+    }
+    if (workqueue_pool_queue_init(wq, pool, weight) < 0) {
+        workqueue_manager_detach(wq);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+workqueue_pool_push(workqueue_t *wq, const work_item_t *item)
+{
+    workqueue_pool_queue_t *q = wq->priv;
+    workqueue_pool_t *pool = q->pool;
+    bool spawn;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (q->shutdown) {
+        pthread_mutex_unlock(&pool->mutex);
+        errno = EPIPE;
+        return -1;
+    }
+
+    if (q->count == q->size) {
+        unsigned int size = (q->size) ? q->size * 2 : 16, i;
+        work_item_t *items = malloc(size * sizeof(*items));
+
+        if (items == NULL) {
+            pthread_mutex_unlock(&pool->mutex);
+            return -1;
+        }
+        for (i = 0; i < q->count; i++) {
+            items[i] = q->items[(q->head + i) % q->size];
+        }
+        free(q->items);
+        q->items = items;
+        q->head = 0;
+        q->size = size;
+    }
+    q->items[(q->head + q->count) % q->size] = *item;
+    q->count++;
+    wq_atomic_add_fetch(&q->c.queued, 1);
+
+    if (!q->active) {
+        workqueue_pool_append(pool, q);
+    }
+
+    spawn = false;
+    if (pool->sleepers > 0) {
+        pthread_cond_signal(&pool->work_cond);
+    } else {
+        spawn = (pool->current <
+                 workqueue_pool_max_workers(pool) + pool->blocked);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    /* worker creation happens asynchronously, see manager.c. */
+    if (spawn) {
+        workqueue_manager_request(wq);
+    }
+    return 0;
+}
+
+static void
+workqueue_pool_shutdown(workqueue_t *wq)
+{
+    workqueue_pool_queue_t *q = wq->priv;
+    workqueue_pool_t *pool = q->pool;
+
+    /* wait for the running items with the queue unlocked, they may need
+       it to complete. */
+    workqueue_counters_unlock(&q->c, &q->mutex);
+
+    pthread_mutex_lock(&pool->mutex);
+    q->shutdown = true;
+    wq_atomic_store(&q->c.shutdown, true);
+    if (q->active) {
+        workqueue_pool_unlink(pool, q);
+    }
+    /* like the other backends, items nobody picked up are dropped. */
+    wq_atomic_sub_fetch(&q->c.queued, q->count);
+    q->count = 0;
+    while (q->running > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    pool->queues--;
+    pthread_mutex_unlock(&pool->mutex);
+
+    workqueue_counters_lock(&q->c, &q->mutex);
+}
+
+static void
+workqueue_pool_destroy_queue(workqueue_t *wq)
+{
+    workqueue_pool_queue_t *q = wq->priv;
+
+    if (q == NULL) {
+        return;
+    }
+    /* workqueue_destroy() leaves the queue locked. */
+    if (workqueue_counters_owned(&q->c)) {
+        workqueue_counters_unlock(&q->c, &q->mutex);
+    }
+    free(q->items);
+    pthread_cond_destroy(&q->completion_cond);
+    pthread_mutex_destroy(&q->mutex);
+    wq_aligned_free(q);
+    wq->priv = NULL;
+}
+
+static void
+workqueue_pool_lock(workqueue_t *wq)
+{
+    workqueue_pool_queue_t *q = wq->priv;
+    workqueue_counters_lock(&q->c, &q->mutex);
+}
+
+static void
+workqueue_pool_unlock(workqueue_t *wq)
+{
+    workqueue_pool_queue_t *q = wq->priv;
+    workqueue_counters_unlock(&q->c, &q->mutex);
+}
+
+static bool
+workqueue_pool_locked(workqueue_t *wq)
+{
+    workqueue_pool_queue_t *q = wq->priv;
+    return workqueue_counters_owned(&q->c);
+}
+
+static int
+workqueue_pool_wait(workqueue_t *wq, unsigned int timeout)
+{
+    workqueue_pool_queue_t *q = wq->priv;
+    int rc;
+
+    workqueue_counters_sleep(&q->c, &q->c.waiters);
+    if (timeout) {
+        struct timeval now;
+        struct timespec ts;
+
+        gettimeofday(&now, NULL);
+        ts.tv_sec = now.tv_sec + timeout;
+        ts.tv_nsec = now.tv_usec * 1000;
+        rc = pthread_cond_timedwait(&q->completion_cond, &q->mutex, &ts);
+    } else {
+        rc = pthread_cond_wait(&q->completion_cond, &q->mutex);
+    }
+    workqueue_counters_wake(&q->c, &q->c.waiters);
+    return rc;
+}
+
+/* available stays 0, so the queue is idle once nothing is queued or
+   running. */
+static int
+workqueue_pool_stat(workqueue_t *wq, workqueue_stat_t *st)
+{
+    workqueue_pool_queue_t *q = wq->priv;
+    workqueue_counters_stat(&q->c, st);
+    return 0;
+}
+
+static void
+workqueue_pool_worker_complete(workqueue_t *wq)
+{
+    workqueue_pool_complete(wq->priv);
+}
+
+static int
+workqueue_pool_self(workqueue_t *wq)
+{
+    return workqueue_pool_worker_id;
+}
+
+/* workqueue_blocking_begin() asks the manager for the extra worker. */
+static void
+workqueue_pool_blocking(workqueue_t *wq, int n)
+{
+    workqueue_pool_queue_t *q = wq->priv;
+    workqueue_pool_t *pool = q->pool;
+
+    workqueue_counters_blocking(&q->c, n);
+    pthread_mutex_lock(&pool->mutex);
+    pool->blocked += n;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+const workqueue_backend_t
+workqueue_pool_backend = {
+    .name = "pool",
+    .flags = WORKQUEUE_BACKEND_SHARED_MEMORY,
+    .shutdown = workqueue_pool_shutdown,
+    .destroy = workqueue_pool_destroy_queue,
+    .lock = workqueue_pool_lock,
+    .unlock = workqueue_pool_unlock,
+    .locked = workqueue_pool_locked,
+    .wait = workqueue_pool_wait,
+    .stat = workqueue_pool_stat,
+    .push = workqueue_pool_push,
+    .worker_create = workqueue_pool_worker_create,
+    .worker_complete = workqueue_pool_worker_complete,
+    .self = workqueue_pool_self,
+    .blocking = workqueue_pool_blocking,
+};
+
+static int
+workqueue_nofd_init(workqueue_t *wq)
+{
+    workqueue_pool_t *pool;
+
+    pool = workqueue_pool_create(0);
+    if (pool == NULL) {
+        return -1;
+    }
+    pool->owner = wq;
+    if (workqueue_pool_queue_init(wq, pool, 1) < 0) {
+        workqueue_pool_destroy(pool);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+workqueue_nofd_destroy(workqueue_t *wq)
+{
+    workqueue_pool_queue_t *q = wq->priv;
+    workqueue_pool_t *pool;
+
+    if (q == NULL) {
+        return;
+    }
+    pool = q->pool;
+    workqueue_pool_destroy_queue(wq);
+    workqueue_pool_destroy(pool);
+}
+
+const workqueue_backend_t
+workqueue_nofd_backend = {
+    .name = "nofd",
+    .flags = WORKQUEUE_BACKEND_SHARED_MEMORY,
+    .init = workqueue_nofd_init,
+    .shutdown = workqueue_pool_shutdown,
+    .destroy = workqueue_nofd_destroy,
+    .lock = workqueue_pool_lock,
+    .unlock = workqueue_pool_unlock,
+    .locked = workqueue_pool_locked,
+    .wait = workqueue_pool_wait,
+    .stat = workqueue_pool_stat,
+    .push = workqueue_pool_push,
+    .worker_create = workqueue_pool_worker_create,
+    .worker_complete = workqueue_pool_worker_complete,
+    .self = workqueue_pool_self,
+    .blocking = workqueue_pool_blocking,
+};
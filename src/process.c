@@ -24,24 +24,71 @@
 #include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 
 #include <wq.h>
 
+#include "worker.h"
+#include "counters.h"
+#include "attr.h"
+#include "pcond.h"
+#include "manager.h"
+
+#define WORKQUEUE_PROCESS_GROUPS 64
+#define WORKQUEUE_PROCESS_THREADS 4
+/* wq->max_rss is checked every so many items. */
+#define WORKQUEUE_PROCESS_RSS_INTERVAL 32
+
+/* A child process of the "hybrid" backend, running up to
+   wq->process_threads workers; protected by the mutex, but for 'busy'. */
+typedef struct workqueue_process_group {
+    pid_t pid;                  /* 0 if free, -1 while forking */
+    unsigned int threads;       /* counted in 'current' */
+    unsigned int started;       /* past worker_start() */
+    unsigned int requests;      /* threads the child has yet to start */
+    unsigned int busy;          /* of 'started', running an item */
+    workqueue_pcond_t cond;
+} workqueue_process_group_t;
+
 typedef struct workqueue_process_private {
+    workqueue_counters_t c;
     pthread_mutex_t mutex;
     pthread_mutexattr_t mutexattr;
-    pthread_cond_t work_cond;
-    pthread_cond_t completion_cond;
-    pthread_cond_t shutdown_cond;
-    pthread_condattr_t condattr;
-    workqueue_stat_t st;
+    workqueue_pcond_t work_cond;
+    workqueue_pcond_t completion_cond;
+    workqueue_pcond_t shutdown_cond;
+    /* items carrying a descriptor, see workqueue_process_write_fd(). */
+    int sock[2];
+    unsigned int fd_queued;
+    /* recycled workers, see workqueue_process_manage(). */
+    pid_t parent;
+    bool recycle;
+    int standby[2];
+    pid_t standby_pid;          /* 0 if none, -1 while forking */
+    /* hybrid backend only. */
+    int n;
+    workqueue_process_group_t groups[WORKQUEUE_PROCESS_GROUPS];
 } workqueue_process_private_t;
 
-extern int wq_gettime(struct timespec *tp);
+extern const workqueue_backend_t workqueue_process_backend;
+extern const workqueue_backend_t workqueue_hybrid_backend;
+
+/* in a hybrid child, its group. */
+static workqueue_process_group_t *workqueue_process_group;
+static __thread int workqueue_process_thread_id;
+
+/* in a process worker, see workqueue_process_worker_busy(). */
+static unsigned int workqueue_process_items;
+static bool workqueue_process_retiring;
+static bool workqueue_process_handover;
+static int workqueue_process_statm = -1;
+
+static void *workqueue_process_worker(void *arg);
 
 static void
 _workqueue_process_sigchild(int sig, siginfo_t *si, void *unused)
@@ -56,245 +103,491 @@ _workqueue_process_sigchild(int sig, siginfo_t *si, void *unused)
 static int
 workqueue_process_init(workqueue_t *wq)
 {
-    int shmid, rc;
+    int rc, i;
     workqueue_process_private_t *private;
     struct sigaction sa;
 
-    shmid = shmget(IPC_PRIVATE,
-                   sizeof(workqueue_process_private_t),
-                   (0640 | IPC_CREAT));
-    if (shmid < 0) {
+    /* shared with the workers by fork(), and zero filled; unlike a SysV
+       segment it goes away with the last process that maps it. */
+    private = mmap(NULL, sizeof(workqueue_process_private_t),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                   -1, 0);
+    if (private == MAP_FAILED) {
         return -1;
     }
 
-    private = shmat(shmid, NULL, 0);
-    if (private == ((void *)-1)) {
+    /* for workqueue_submit_fd(); made up front since workers forked
+       before it existed would never see it. */
+    rc = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, private->sock);
+    if (rc < 0) {
+        munmap(private, sizeof(workqueue_process_private_t));
         return -1;
     }
-
-    memset(private, 0, sizeof(workqueue_process_private_t));
-    private->st.shutdown = false;
+    fcntl(private->sock[0], F_SETFL,
+          fcntl(private->sock[0], F_GETFL) | O_NONBLOCK);
 
     rc = pthread_mutexattr_init(&private->mutexattr);
     if (rc < 0) {
-        shmdt(private);
+        close(private->sock[0]);
+        close(private->sock[1]);
+        munmap(private, sizeof(workqueue_process_private_t));
         return -1;
     }
     pthread_mutexattr_setpshared(&private->mutexattr, PTHREAD_PROCESS_SHARED);
-
-    rc = pthread_condattr_init(&private->condattr);
-    if (rc < 0) {
-        pthread_mutexattr_destroy(&private->mutexattr);
-        shmdt(private);
-        return -1;
-    }
-    pthread_condattr_setpshared(&private->condattr, PTHREAD_PROCESS_SHARED);
+    /* a worker may die holding it, see workqueue_counters_lock(). */
+    pthread_mutexattr_setrobust(&private->mutexattr, PTHREAD_MUTEX_ROBUST);
 
     pthread_mutex_init(&private->mutex, &private->mutexattr);
-    pthread_cond_init(&private->work_cond, &private->condattr);
-    pthread_cond_init(&private->completion_cond, &private->condattr);
-    pthread_cond_init(&private->shutdown_cond, &private->condattr);
-
+    workqueue_pcond_init(&private->work_cond);
+    workqueue_pcond_init(&private->completion_cond);
+    workqueue_pcond_init(&private->shutdown_cond);
+    for (i = 0; i < WORKQUEUE_PROCESS_GROUPS; i++) {
+        workqueue_pcond_init(&private->groups[i].cond);
+    }
 
     sigaction(SIGCHLD, NULL, &sa);
     if (sa.sa_handler == NULL && sa.sa_sigaction == NULL) {
-        sa.sa_flags = SA_SIGINFO | SA_NOCLDSTOP;
+        /* recycled workers make child exits routine. */
+        sa.sa_flags = SA_SIGINFO | SA_NOCLDSTOP | SA_RESTART;
         sigemptyset(&sa.sa_mask);
         sa.sa_sigaction = _workqueue_process_sigchild;
         sigaction(SIGCHLD, &sa, NULL);
     }
 
-    wq->private = private;
+    private->parent = getpid();
+    wq->priv = private;
     return 0;
 }
 
 static void
 workqueue_process_destroy(workqueue_t *wq)
 {
-    workqueue_process_private_t *private = wq->private;
+    workqueue_process_private_t *private = wq->priv;
     assert(private != NULL);
     pthread_mutexattr_destroy(&private->mutexattr);
-    pthread_condattr_destroy(&private->condattr);
-    shmdt(private);
+    close(private->sock[0]);
+    close(private->sock[1]);
+    if (private->recycle) {
+        close(private->standby[0]);
+        close(private->standby[1]);
+    }
+    munmap(private, sizeof(workqueue_process_private_t));
+}
+
+static inline bool
+_workqueue_process_locked(workqueue_process_private_t *private)
+{
+    return workqueue_counters_owned(&private->c);
 }
 
 static void
 workqueue_process_shutdown(workqueue_t *wq)
 {
     int rc = 0;
-    workqueue_process_private_t *private = wq->private;
+    workqueue_process_private_t *private = wq->priv;
+    assert(_workqueue_process_locked(private));
 
-    private->st.shutdown = true;
-    pthread_cond_broadcast(&private->work_cond);
-    close(wq->pipefds[WORKQUEUE_READ_PIPE]);
+    wq_atomic_store(&private->c.shutdown, true);
+    workqueue_pcond_broadcast(&private->work_cond);
 
-    while (private->st.current > 0 && rc == 0) {
-        rc = pthread_cond_wait(&private->shutdown_cond, &private->mutex);
+    while (wq_atomic_load(&private->c.current) > 0 && rc == 0) {
+        workqueue_counters_sleep(&private->c, NULL);
+        rc = workqueue_pcond_wait(&private->shutdown_cond, &private->mutex,
+                                  0);
+        workqueue_counters_wake(&private->c, NULL);
     }
 }
 
-static bool
-_workqueue_process_locked(workqueue_process_private_t *private)
-{
-    int rc;
-
-    rc = pthread_mutex_trylock(&private->mutex);
-    if (rc == EBUSY) {
-        return true;
-    } else if (rc != 0) {
-        return false;
-    }
-    pthread_mutex_unlock(&private->mutex);
-    return false;
-}
-
 static bool
 workqueue_process_locked(workqueue_t *wq)
 {
-    workqueue_process_private_t *private = wq->private;
+    workqueue_process_private_t *private = wq->priv;
     return _workqueue_process_locked(private);
 }
 
 static void
 workqueue_process_lock(workqueue_t *wq)
 {
-    workqueue_process_private_t *private = wq->private;
-    pthread_mutex_lock(&private->mutex);
+    workqueue_process_private_t *private = wq->priv;
+    workqueue_counters_lock(&private->c, &private->mutex);
 }
 
 static void
 workqueue_process_unlock(workqueue_t *wq)
 {
-    workqueue_process_private_t *private = wq->private;
-    assert(_workqueue_process_locked(private));
-    pthread_mutex_unlock(&private->mutex);
+    workqueue_process_private_t *private = wq->priv;
+    workqueue_counters_unlock(&private->c, &private->mutex);
 }
 
 static int
-_workqueue_process_cond_wait(pthread_cond_t *cond,
-                             pthread_mutex_t *mutex,
+_workqueue_process_cond_wait(workqueue_process_private_t *private,
+                             workqueue_pcond_t *cond,
+                             unsigned int *count,
                              unsigned int timeout)
 {
-    int rc = 0;
-
-    if (timeout) {
-        struct timespec ts;
-        wq_gettime(&ts);
-        ts.tv_sec += timeout;
-        rc = pthread_cond_timedwait(cond, mutex, &ts);
-        if (rc == ETIMEDOUT) {
-            return rc;
-        }
-    } else {
-        rc = pthread_cond_wait(cond, mutex);
-    }
+    int rc;
 
+    assert(_workqueue_process_locked(private));
+    workqueue_counters_sleep(&private->c, count);
+    rc = workqueue_pcond_wait(cond, &private->mutex, timeout);
+    workqueue_counters_wake(&private->c, count);
     return rc;
 }
 
+/* Once the standby took over, the next submit or wait in the submitting
+   process has the manager fork another one. */
+static void
+_workqueue_process_standby_check(workqueue_t *wq)
+{
+    workqueue_process_private_t *private = wq->priv;
+
+    if (wq_atomic_load_relaxed(&private->recycle) &&
+        wq_atomic_load(&private->standby_pid) == 0 &&
+        getpid() == private->parent) {
+        workqueue_manager_request(wq);
+    }
+}
+
 static void
 workqueue_process_submit(struct workqueue *wq)
 {
-    workqueue_process_private_t *private = wq->private;
-    pthread_cond_signal(&private->work_cond);
+    workqueue_process_private_t *private = wq->priv;
+    if (workqueue_counters_contended(&private->c, &private->c.sleepers)) {
+        workqueue_counters_lock(&private->c, &private->mutex);
+        workqueue_pcond_signal(&private->work_cond);
+        workqueue_counters_unlock(&private->c, &private->mutex);
+    }
+    _workqueue_process_standby_check(wq);
+}
+
+static void
+workqueue_process_enqueue(struct workqueue *wq, int n)
+{
+    workqueue_process_private_t *private = wq->priv;
+    wq_atomic_add_fetch(&private->c.queued, n);
 }
 
 static int
 workqueue_process_wait(struct workqueue *wq, unsigned int timeout)
 {
-    workqueue_process_private_t *private = wq->private;
-    return _workqueue_process_cond_wait(&private->completion_cond,
-                                       &private->mutex,
-                                       timeout);
+    workqueue_process_private_t *private = wq->priv;
+    _workqueue_process_standby_check(wq);
+    return _workqueue_process_cond_wait(private, &private->completion_cond,
+                                        &private->c.waiters, timeout);
+}
+
+/* The item and the descriptor travel together in one message, so
+   whichever worker receives the item also gets (its own copy of) the
+   descriptor.  'fd_queued' spares the other workers the recvmsg(). */
+static int
+workqueue_process_write_fd(struct workqueue *wq, const work_item_t *item,
+                           int fd)
+{
+    workqueue_process_private_t *private = wq->priv;
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { (void *)item, sizeof(*item) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(buf, 0, sizeof(buf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    wq_atomic_add_fetch(&private->fd_queued, 1);
+    if (sendmsg(private->sock[1], &msg, 0) < 0) {
+        wq_atomic_sub_fetch(&private->fd_queued, 1);
+        return -1;
+    }
+    return 0;
+}
+
+static bool
+workqueue_process_worker_handoff(struct workqueue *wq, work_item_t *item)
+{
+    workqueue_process_private_t *private = wq->priv;
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { item, sizeof(*item) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int flags = 0;
+
+    if (wq_atomic_load(&private->fd_queued) == 0) {
+        return false;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+#ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+    if (recvmsg(private->sock[0], &msg, flags) != sizeof(*item)) {
+        return false;
+    }
+    wq_atomic_sub_fetch(&private->fd_queued, 1);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&workqueue_item_fdesc, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return true;
 }
 
 static int
 workqueue_process_stat(workqueue_t *wq, workqueue_stat_t *st)
 {
-    workqueue_process_private_t *private = wq->private;
-    assert(_workqueue_process_locked(private));
-    *st = private->st;
+    workqueue_process_private_t *private = wq->priv;
+    workqueue_counters_stat(&private->c, st);
     return 0;
 }
 
+/* Workers retire after wq->max_items items or past wq->max_rss, see
+   workqueue_process_worker_busy().  The submitting process keeps one
+   standby forked for the queue, a clean copy of itself: a retiring
+   worker claims it (see workqueue_process_worker_retire()), passes its
+   place in 'current' on through a pipe and the standby carries on as a
+   worker at once.  The manager then forks the next standby, so fork()
+   is never on a worker's path and there is at most one standby; a
+   worker over its limits keeps serving until there is one. */
+static void
+_workqueue_process_standby(workqueue_t *wq)
+{
+    workqueue_process_private_t *private = wq->priv;
+    struct pollfd pfd;
+    char c;
+
+    pfd.fd = private->standby[0];
+    pfd.events = POLLIN;
+    while (1) {
+        /* once a second, see if the queue is still there. */
+        int rc = poll(&pfd, 1, 1000);
+
+        if (rc > 0 && read(private->standby[0], &c, 1) == 1) {
+            break;
+        }
+        if (rc < 0 && errno != EINTR) {
+            return;
+        }
+        if (wq_atomic_load(&private->c.shutdown) ||
+            getppid() != private->parent) {
+            return;
+        }
+    }
+    workqueue_process_worker(wq);
+}
+
+/* Called by the manager in the submitting process. */
+static void
+workqueue_process_manage(workqueue_t *wq)
+{
+    workqueue_process_private_t *private = wq->priv;
+    sigset_t set, oldset;
+    pid_t pid, expected = 0;
+
+    if (!wq_atomic_load_relaxed(&private->recycle) ||
+        wq_atomic_load(&private->c.shutdown) ||
+        !wq_atomic_cas(&private->standby_pid, &expected, -1)) {
+        return;
+    }
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    pid = fork();
+    if (pid == 0) {
+        _workqueue_process_standby(wq);
+        exit(0);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    wq_atomic_store(&private->standby_pid, (pid > 0) ? pid : 0);
+}
+
 static int
 workqueue_process_worker_create(struct workqueue *wq, void *(*func)(void *))
 {
     sigset_t set, oldset;
     pid_t pid;
+    int rc;
+    unsigned int max;
 
-    workqueue_process_private_t *private = wq->private;
-    assert(_workqueue_process_locked(private));
+    workqueue_process_private_t *private = wq->priv;
+
+    workqueue_counters_lock(&private->c, &private->mutex);
+    max = workqueue_max_workers(wq) + wq_atomic_load(&private->c.blocked);
+    if (private->c.current >= max || private->c.shutdown) {
+        workqueue_counters_unlock(&private->c, &private->mutex);
+        return EAGAIN;
+    }
+    wq_atomic_add_fetch(&private->c.current, 1);
+    workqueue_counters_unlock(&private->c, &private->mutex);
+
+    /* before the fork, so that the worker has the standby's pipe. */
+    if ((wq->max_items > 0 || wq->max_rss > 0) &&
+        !wq_atomic_load_relaxed(&private->recycle) &&
+        getpid() == private->parent && pipe(private->standby) == 0) {
+        wq_atomic_store(&private->recycle, true);
+    }
 
     sigfillset(&set);
-    sigprocmask(SIG_BLOCK, &set, &oldset);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
 
     pid = fork();
     if (pid == 0) {
         // child
         func(wq);
         exit(0);
-    } else if (pid < 0) {
-        // failed
-        return -1;
-    } else {
-        // parent
-        private->st.current++;
     }
+    rc = errno;
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
 
-    sigprocmask(SIG_SETMASK, &oldset, NULL);
+    if (pid < 0) {
+        // failed
+        workqueue_counters_lock(&private->c, &private->mutex);
+        wq_atomic_sub_fetch(&private->c.current, 1);
+        workqueue_pcond_signal(&private->shutdown_cond);
+        workqueue_pcond_broadcast(&private->completion_cond);
+        workqueue_counters_unlock(&private->c, &private->mutex);
+        return rc;
+    }
     return 0;
 }
 
 static void
 workqueue_process_worker_start(struct workqueue *wq)
 {
-    workqueue_process_private_t *private = wq->private;
+    workqueue_process_private_t *private = wq->priv;
     assert(_workqueue_process_locked(private));
-    private->st.available++;
+    wq_atomic_add_fetch(&private->c.available, 1);
 }
 
 
 static int
 workqueue_process_worker_wait(workqueue_t *wq)
 {
-    workqueue_process_private_t *private = wq->private;
-    return _workqueue_process_cond_wait(&private->work_cond,
-                                       &private->mutex,
-                                       wq->timeout);
+    workqueue_process_private_t *private = wq->priv;
+    return _workqueue_process_cond_wait(private, &private->work_cond,
+                                        &private->c.sleepers, wq->timeout);
 }
 
 static void
 workqueue_process_worker_finish(struct workqueue *wq)
 {
-    workqueue_process_private_t *private = wq->private;
+    workqueue_process_private_t *private = wq->priv;
+    char c = 0;
+
     assert(_workqueue_process_locked(private));
-    private->st.available--;
-    private->st.current--;
-    pthread_cond_signal(&private->shutdown_cond);
+    wq_atomic_sub_fetch(&private->c.available, 1);
+    if (workqueue_process_handover &&
+        write(private->standby[1], &c, 1) == 1) {
+        /* the standby takes over this worker's place. */
+        return;
+    }
+    wq_atomic_sub_fetch(&private->c.current, 1);
+    workqueue_pcond_signal(&private->shutdown_cond);
 }
 
 static void
 workqueue_process_worker_idle(struct workqueue *wq)
 {
-    workqueue_process_private_t *private = wq->private;
-    assert(_workqueue_process_locked(private));
-    private->st.available++;
+    workqueue_process_private_t *private = wq->priv;
+    __atomic_add_fetch(&private->c.available, 1, __ATOMIC_SEQ_CST);
+}
+
+/* The resident set size from /proc, 0 if unknown. */
+static size_t
+_workqueue_process_rss(void)
+{
+    char buf[64];
+    unsigned long size, resident;
+    ssize_t n;
+
+    if (workqueue_process_statm < 0) {
+        workqueue_process_statm = open("/proc/self/statm", O_RDONLY);
+    }
+    n = pread(workqueue_process_statm, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    if (sscanf(buf, "%lu %lu", &size, &resident) != 2) {
+        return 0;
+    }
+    return (size_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+/* A worker over its limits only goes once it has claimed the standby,
+   until then it keeps serving. */
+static bool
+workqueue_process_worker_retire(struct workqueue *wq)
+{
+    workqueue_process_private_t *private = wq->priv;
+    pid_t pid;
+
+    if (!workqueue_process_retiring) {
+        return false;
+    }
+    if (!workqueue_process_handover) {
+        pid = wq_atomic_load(&private->standby_pid);
+        workqueue_process_handover = pid > 0 &&
+            (kill(pid, 0) == 0 || errno != ESRCH) &&
+            wq_atomic_cas(&private->standby_pid, &pid, 0);
+    }
+    return workqueue_process_handover;
+}
+
+/* available goes down before queued so the queue never looks idle. */
+static void
+_workqueue_process_busy(workqueue_process_private_t *private)
+{
+    wq_atomic_sub_fetch(&private->c.available, 1);
+    wq_atomic_sub_fetch(&private->c.queued, 1);
 }
 
+/* Counts the items of this worker against wq->max_items and, every
+   WORKQUEUE_PROCESS_RSS_INTERVAL items, wq->max_rss; once over either,
+   it retires as soon as it can hand its place over. */
 static void
 workqueue_process_worker_busy(struct workqueue *wq)
 {
-    workqueue_process_private_t *private = wq->private;
-    assert(_workqueue_process_locked(private));
-    private->st.available--;
+    workqueue_process_private_t *private = wq->priv;
+
+    workqueue_process_items++;
+    if (!workqueue_process_retiring &&
+        ((wq->max_items > 0 && workqueue_process_items >= wq->max_items) ||
+         (wq->max_rss > 0 &&
+          workqueue_process_items % WORKQUEUE_PROCESS_RSS_INTERVAL == 1 &&
+          _workqueue_process_rss() > wq->max_rss))) {
+        workqueue_process_retiring = true;
+    }
+    _workqueue_process_busy(private);
 }
 
 static void
 workqueue_process_worker_complete(struct workqueue *wq)
 {
-    workqueue_process_private_t *private = wq->private;
-    pthread_cond_broadcast(&private->completion_cond);
+    workqueue_process_private_t *private = wq->priv;
+    if (workqueue_counters_contended(&private->c, &private->c.waiters)) {
+        workqueue_counters_lock(&private->c, &private->mutex);
+        workqueue_pcond_broadcast(&private->completion_cond);
+        workqueue_counters_unlock(&private->c, &private->mutex);
+    }
+}
+
+static void
+workqueue_process_blocking(struct workqueue *wq, int n)
+{
+    workqueue_process_private_t *private = wq->priv;
+    workqueue_counters_blocking(&private->c, n);
 }
 
 static int
@@ -303,7 +596,15 @@ workqueue_process_self(workqueue_t *wq)
     return getpid();
 }
 
-workqueue_backend_t
+/* The worker loop specialized for this backend. */
+static void *
+workqueue_process_worker(void *arg)
+{
+    return workqueue_worker_main((workqueue_t *)arg,
+                                 &workqueue_process_backend);
+}
+
+const workqueue_backend_t
 workqueue_process_backend = {
     .name = "process",
     .init = workqueue_process_init,
@@ -313,16 +614,316 @@ workqueue_process_backend = {
     .unlock = workqueue_process_unlock,
     .locked = workqueue_process_locked,
     .submit = workqueue_process_submit,
+    .enqueue = workqueue_process_enqueue,
+    .write_fd = workqueue_process_write_fd,
     .wait = workqueue_process_wait,
     .stat = workqueue_process_stat,
 
     .worker_create = workqueue_process_worker_create,
     .worker_start = workqueue_process_worker_start,
     .worker_wait = workqueue_process_worker_wait,
+    .worker_handoff = workqueue_process_worker_handoff,
     .worker_idle = workqueue_process_worker_idle,
     .worker_busy = workqueue_process_worker_busy,
     .worker_complete = workqueue_process_worker_complete,
     .worker_finish = workqueue_process_worker_finish,
 
     .self = workqueue_process_self,
+    .blocking = workqueue_process_blocking,
+    .worker = workqueue_process_worker,
+    .worker_retire = workqueue_process_worker_retire,
+    .manage = workqueue_process_manage,
+};
+
+/* The "hybrid" backend: child processes as above, each running a pool
+   of threads.  All of them take items from the same pipe and share the
+   counters, so apart from worker creation it works like "process":
+   'current' counts threads, and the manager asks a child with room for
+   another thread before forking a new one.  A crashed child only takes
+   its own group's threads and items down; the survivors and the parent
+   notice when they next look (see _workqueue_hybrid_reap()). */
+
+static bool
+_workqueue_hybrid_alive(pid_t pid)
+{
+    if (waitpid(pid, NULL, WNOHANG) == pid) {
+        return false;
+    }
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/* Forgets the threads of children that died without cleaning up after
+   themselves; called with the lock held. */
+static void
+_workqueue_hybrid_reap(workqueue_process_private_t *private)
+{
+    int i;
+
+    for (i = 0; i < WORKQUEUE_PROCESS_GROUPS; i++) {
+        workqueue_process_group_t *g = &private->groups[i];
+        unsigned int busy;
+
+        if (g->pid <= 0 || _workqueue_hybrid_alive(g->pid)) {
+            continue;
+        }
+        WERROR("hybrid child %d died with %u threads\n", (int)g->pid,
+               g->threads);
+        busy = wq_atomic_load(&g->busy);
+        wq_atomic_sub_fetch(&private->c.available, g->started - busy);
+        wq_atomic_sub_fetch(&private->c.current, g->threads);
+        g->threads = g->started = g->requests = 0;
+        wq_atomic_store(&g->busy, 0);
+        g->pid = 0;
+        workqueue_pcond_broadcast(&private->shutdown_cond);
+        workqueue_pcond_broadcast(&private->completion_cond);
+    }
+}
+
+static void
+workqueue_hybrid_shutdown(workqueue_t *wq)
+{
+    workqueue_process_private_t *private = wq->priv;
+    int i;
+
+    assert(_workqueue_process_locked(private));
+    wq_atomic_store(&private->c.shutdown, true);
+    workqueue_pcond_broadcast(&private->work_cond);
+    for (i = 0; i < WORKQUEUE_PROCESS_GROUPS; i++) {
+        workqueue_pcond_broadcast(&private->groups[i].cond);
+    }
+
+    /* with a timeout: a child may die without saying so. */
+    while (wq_atomic_load(&private->c.current) > 0) {
+        _workqueue_hybrid_reap(private);
+        if (wq_atomic_load(&private->c.current) == 0) {
+            break;
+        }
+        _workqueue_process_cond_wait(private, &private->shutdown_cond,
+                                     NULL, 1);
+    }
+}
+
+static int
+workqueue_hybrid_wait(struct workqueue *wq, unsigned int timeout)
+{
+    workqueue_process_private_t *private = wq->priv;
+    int rc;
+
+    _workqueue_hybrid_reap(private);
+    if (timeout) {
+        return _workqueue_process_cond_wait(private,
+                                            &private->completion_cond,
+                                            &private->c.waiters, timeout);
+    }
+    /* callers recheck their condition, see workqueue_wait(). */
+    rc = _workqueue_process_cond_wait(private, &private->completion_cond,
+                                      &private->c.waiters, 1);
+    return (rc == ETIMEDOUT) ? 0 : rc;
+}
+
+static void *
+workqueue_hybrid_worker(void *arg)
+{
+    return workqueue_worker_main((workqueue_t *)arg,
+                                 &workqueue_hybrid_backend);
+}
+
+/* A child's main thread: starts the threads the parent asks for and
+   leaves once the last one has exited. */
+static void
+workqueue_hybrid_group_main(workqueue_t *wq, workqueue_process_group_t *g)
+{
+    workqueue_process_private_t *private = wq->priv;
+    pthread_attr_t attr;
+    pthread_t t;
+    int rc;
+
+    workqueue_process_group = g;
+    workqueue_counters_lock(&private->c, &private->mutex);
+    while (1) {
+        if (g->requests > 0 && private->c.shutdown) {
+            g->threads -= g->requests;
+            wq_atomic_sub_fetch(&private->c.current, g->requests);
+            g->requests = 0;
+            workqueue_pcond_broadcast(&private->shutdown_cond);
+            continue;
+        }
+        if (g->requests > 0) {
+            g->requests--;
+            workqueue_counters_unlock(&private->c, &private->mutex);
+
+            workqueue_attr_init(&attr, wq->stack_size, wq->guard_size);
+            rc = pthread_create(&t, &attr, workqueue_hybrid_worker, wq);
+            pthread_attr_destroy(&attr);
+
+            workqueue_counters_lock(&private->c, &private->mutex);
+            if (rc == 0) {
+                pthread_detach(t);
+            } else {
+                g->threads--;
+                wq_atomic_sub_fetch(&private->c.current, 1);
+                workqueue_pcond_broadcast(&private->shutdown_cond);
+                workqueue_pcond_broadcast(&private->completion_cond);
+            }
+            continue;
+        }
+        if (g->threads == 0) {
+            break;
+        }
+        _workqueue_process_cond_wait(private, &g->cond, NULL, 0);
+    }
+    g->pid = 0;
+    workqueue_counters_unlock(&private->c, &private->mutex);
+}
+
+static int
+workqueue_hybrid_worker_create(struct workqueue *wq, void *(*func)(void *))
+{
+    workqueue_process_private_t *private = wq->priv;
+    workqueue_process_group_t *g = NULL;
+    unsigned int max, per = (wq->process_threads > 0) ?
+        wq->process_threads : WORKQUEUE_PROCESS_THREADS;
+    sigset_t set, oldset;
+    pid_t pid;
+    int i, rc;
+
+    workqueue_counters_lock(&private->c, &private->mutex);
+    _workqueue_hybrid_reap(private);
+    max = workqueue_max_workers(wq) + wq_atomic_load(&private->c.blocked);
+    if (private->c.current >= max || private->c.shutdown) {
+        workqueue_counters_unlock(&private->c, &private->mutex);
+        return EAGAIN;
+    }
+
+    /* another thread in a child that has room... */
+    for (i = 0; i < WORKQUEUE_PROCESS_GROUPS; i++) {
+        g = &private->groups[i];
+        if (g->pid > 0 && g->threads > 0 && g->threads < per) {
+            g->threads++;
+            g->requests++;
+            wq_atomic_add_fetch(&private->c.current, 1);
+            workqueue_pcond_signal(&g->cond);
+            workqueue_counters_unlock(&private->c, &private->mutex);
+            return 0;
+        }
+    }
+
+    /* ...or a new child. */
+    for (i = 0; i < WORKQUEUE_PROCESS_GROUPS; i++) {
+        if (private->groups[i].pid == 0) {
+            break;
+        }
+    }
+    if (i == WORKQUEUE_PROCESS_GROUPS) {
+        workqueue_counters_unlock(&private->c, &private->mutex);
+        return EAGAIN;
+    }
+    g = &private->groups[i];
+    g->pid = -1;
+    g->threads = 1;
+    g->requests = 1;
+    wq_atomic_add_fetch(&private->c.current, 1);
+    workqueue_counters_unlock(&private->c, &private->mutex);
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+    pid = fork();
+    if (pid == 0) {
+        // child
+        workqueue_hybrid_group_main(wq, g);
+        exit(0);
+    }
+    rc = errno;
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    workqueue_counters_lock(&private->c, &private->mutex);
+    if (pid < 0) {
+        g->pid = 0;
+        g->threads = g->requests = 0;
+        wq_atomic_sub_fetch(&private->c.current, 1);
+        workqueue_pcond_signal(&private->shutdown_cond);
+        workqueue_pcond_broadcast(&private->completion_cond);
+        workqueue_counters_unlock(&private->c, &private->mutex);
+        return rc;
+    }
+    /* unless it already came and went. */
+    if (g->pid == -1) {
+        g->pid = pid;
+    }
+    workqueue_counters_unlock(&private->c, &private->mutex);
+    return 0;
+}
+
+static void
+workqueue_hybrid_worker_start(struct workqueue *wq)
+{
+    workqueue_process_private_t *private = wq->priv;
+
+    assert(_workqueue_process_locked(private));
+    wq_atomic_add_fetch(&private->c.available, 1);
+    workqueue_process_group->started++;
+    workqueue_process_thread_id = ++private->n;
+}
+
+static void
+workqueue_hybrid_worker_finish(struct workqueue *wq)
+{
+    workqueue_process_private_t *private = wq->priv;
+    workqueue_process_group_t *g = workqueue_process_group;
+
+    assert(_workqueue_process_locked(private));
+    g->started--;
+    g->threads--;
+    workqueue_pcond_signal(&g->cond);
+    workqueue_process_worker_finish(wq);
+}
+
+static void
+workqueue_hybrid_worker_idle(struct workqueue *wq)
+{
+    wq_atomic_sub_fetch(&workqueue_process_group->busy, 1);
+    workqueue_process_worker_idle(wq);
+}
+
+static void
+workqueue_hybrid_worker_busy(struct workqueue *wq)
+{
+    wq_atomic_add_fetch(&workqueue_process_group->busy, 1);
+    _workqueue_process_busy(wq->priv);
+}
+
+static int
+workqueue_hybrid_self(workqueue_t *wq)
+{
+    return workqueue_process_thread_id;
+}
+
+const workqueue_backend_t
+workqueue_hybrid_backend = {
+    .name = "hybrid",
+    .init = workqueue_process_init,
+    .shutdown = workqueue_hybrid_shutdown,
+    .destroy = workqueue_process_destroy,
+    .lock = workqueue_process_lock,
+    .unlock = workqueue_process_unlock,
+    .locked = workqueue_process_locked,
+    .submit = workqueue_process_submit,
+    .enqueue = workqueue_process_enqueue,
+    .write_fd = workqueue_process_write_fd,
+    .wait = workqueue_hybrid_wait,
+    .stat = workqueue_process_stat,
+
+    .worker_create = workqueue_hybrid_worker_create,
+    .worker_start = workqueue_hybrid_worker_start,
+    .worker_wait = workqueue_process_worker_wait,
+    .worker_handoff = workqueue_process_worker_handoff,
+    .worker_idle = workqueue_hybrid_worker_idle,
+    .worker_busy = workqueue_hybrid_worker_busy,
+    .worker_complete = workqueue_process_worker_complete,
+    .worker_finish = workqueue_hybrid_worker_finish,
+
+    .self = workqueue_hybrid_self,
+    .blocking = workqueue_process_blocking,
+    .worker = workqueue_hybrid_worker,
 };
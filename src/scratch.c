@@ -0,0 +1,193 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <wq.h>
+
+#include "scratch.h"
+
+/* Per-worker scratch arenas.  Memory comes from a list of chunks that
+   is bump-allocated while an item runs and rewound, not freed, after
+   it returns, so steady-state tasks never reach malloc().
+
+   Trimming: the peak usage of the last WORKQUEUE_SCRATCH_WINDOW items
+   is tracked, and at the end of every window chunks beyond twice that
+   peak (but at least WORKQUEUE_SCRATCH_KEEP bytes) are freed.  A single
+   large task therefore pins its memory for one window at most. */
+#define WORKQUEUE_SCRATCH_CHUNK (64 * 1024)
+#define WORKQUEUE_SCRATCH_KEEP (256 * 1024)
+#define WORKQUEUE_SCRATCH_WINDOW 64
+#define WORKQUEUE_SCRATCH_ALIGN 16
+
+typedef struct workqueue_scratch_chunk {
+    struct workqueue_scratch_chunk *next;
+    size_t size;
+    size_t used;
+    /* keeps data[] aligned to WORKQUEUE_SCRATCH_ALIGN. */
+    size_t pad;
+    char data[];
+} workqueue_scratch_chunk_t;
+
+struct workqueue_scratch {
+    workqueue_scratch_chunk_t *head;
+    workqueue_scratch_chunk_t *cur;
+    size_t capacity;
+    size_t used;        /* by the current item */
+    size_t peak;        /* over the current window */
+    unsigned int items;
+};
+
+__thread workqueue_scratch_t *workqueue_scratch_arena;
+
+static pthread_key_t workqueue_scratch_key;
+static pthread_once_t workqueue_scratch_once = PTHREAD_ONCE_INIT;
+
+static void
+workqueue_scratch_free(void *arg)
+{
+    workqueue_scratch_t *a = arg;
+    workqueue_scratch_chunk_t *c, *next;
+
+    for (c = a->head; c != NULL; c = next) {
+        next = c->next;
+        free(c);
+    }
+    free(a);
+}
+
+static void
+workqueue_scratch_setup(void)
+{
+    pthread_key_create(&workqueue_scratch_key, workqueue_scratch_free);
+}
+
+static workqueue_scratch_t *
+workqueue_scratch_get(void)
+{
+    workqueue_scratch_t *a = workqueue_scratch_arena;
+
+    if (a == NULL) {
+        pthread_once(&workqueue_scratch_once, workqueue_scratch_setup);
+        a = calloc(1, sizeof(*a));
+        if (a == NULL) {
+            return NULL;
+        }
+        /* frees the arena when the thread exits. */
+        pthread_setspecific(workqueue_scratch_key, a);
+        workqueue_scratch_arena = a;
+    }
+    return a;
+}
+
+void *
+workqueue_scratch_alloc(size_t size)
+{
+    workqueue_scratch_t *a = workqueue_scratch_get();
+    workqueue_scratch_chunk_t *c, **pp;
+    size_t chunk;
+    void *p;
+
+    if (a == NULL) {
+        return NULL;
+    }
+    size = (size + WORKQUEUE_SCRATCH_ALIGN - 1) &
+        ~(size_t)(WORKQUEUE_SCRATCH_ALIGN - 1);
+    if (size == 0) {
+        size = WORKQUEUE_SCRATCH_ALIGN;
+    }
+
+    /* the current chunk, or the next one left over from earlier items
+       that is big enough. */
+    pp = (a->cur != NULL) ? &a->cur : &a->head;
+    for (c = *pp; c != NULL; c = c->next) {
+        if (c->size - c->used >= size) {
+            break;
+        }
+    }
+    if (c == NULL) {
+        chunk = (size > WORKQUEUE_SCRATCH_CHUNK) ?
+            size : WORKQUEUE_SCRATCH_CHUNK;
+        c = malloc(sizeof(*c) + chunk);
+        if (c == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        c->size = chunk;
+        c->used = 0;
+        /* append, so the chunks in use stay in front of the spare ones. */
+        for (pp = &a->head; *pp != NULL; pp = &(*pp)->next)
+            ;
+        c->next = NULL;
+        *pp = c;
+        a->capacity += chunk;
+    }
+
+    p = c->data + c->used;
+    c->used += size;
+    a->cur = c;
+    a->used += size;
+    return p;
+}
+
+void
+workqueue_scratch_reset(void)
+{
+    workqueue_scratch_t *a = workqueue_scratch_arena;
+    workqueue_scratch_chunk_t *c, **pp;
+    size_t keep, total;
+
+    if (a == NULL) {
+        return;
+    }
+    for (c = a->head; c != NULL; c = c->next) {
+        c->used = 0;
+    }
+    a->cur = NULL;
+    if (a->used > a->peak) {
+        a->peak = a->used;
+    }
+    a->used = 0;
+
+    if (++a->items < WORKQUEUE_SCRATCH_WINDOW) {
+        return;
+    }
+    keep = 2 * a->peak;
+    if (keep < WORKQUEUE_SCRATCH_KEEP) {
+        keep = WORKQUEUE_SCRATCH_KEEP;
+    }
+    if (a->capacity > keep) {
+        total = 0;
+        for (pp = &a->head; *pp != NULL; ) {
+            c = *pp;
+            if (total + c->size > keep) {
+                *pp = c->next;
+                a->capacity -= c->size;
+                free(c);
+            } else {
+                total += c->size;
+                pp = &c->next;
+            }
+        }
+    }
+    a->items = 0;
+    a->peak = 0;
+}
@@ -0,0 +1,38 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#ifndef __SCRATCH_H__
+#define __SCRATCH_H__
+
+/* Internal side of the scratch arenas, see scratch.c. */
+
+typedef struct workqueue_scratch workqueue_scratch_t;
+
+extern __thread workqueue_scratch_t *workqueue_scratch_arena;
+
+/* called by every worker loop after an item returns. */
+static inline void
+workqueue_scratch_done(void)
+{
+    if (workqueue_scratch_arena != NULL) {
+        workqueue_scratch_reset();
+    }
+}
+
+#endif /* __SCRATCH_H__ */
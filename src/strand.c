@@ -0,0 +1,160 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+
+#include <wq.h>
+
+#include "atomic.h"
+#include "scratch.h"
+
+/* Items per turn before the strand gives its worker back to the queue. */
+#define WORKQUEUE_STRAND_BATCH 64
+
+/* The items form an intrusive multi-producer/single-consumer queue:
+   producers only swap 'tail', and 'head' is touched by whichever work
+   item currently runs the strand.  'pending' counts queued items; the
+   submit that raises it from zero schedules the strand and the run that
+   drops it back to zero releases it, so at most one worker ever runs a
+   given strand and no lock is needed. */
+
+int
+workqueue_strand_init(workqueue_strand_t *s, workqueue_t *wq)
+{
+    if (s == NULL || wq == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!(wq->backend->flags & WORKQUEUE_BACKEND_SHARED_MEMORY)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    s->wq = wq;
+    s->stub.next = NULL;
+    s->head = &s->stub;
+    s->tail = &s->stub;
+    s->pending = 0;
+    return 0;
+}
+
+void
+workqueue_strand_destroy(workqueue_strand_t *s)
+{
+    assert(wq_atomic_load(&s->pending) == 0);
+    if (s->head != &s->stub) {
+        free(s->head);
+    }
+    s->head = s->tail = &s->stub;
+}
+
+bool
+workqueue_strand_idle(workqueue_strand_t *s)
+{
+    return wq_atomic_load(&s->pending) == 0;
+}
+
+/* The popped item's successor becomes the new head (dummy) node. */
+static void
+workqueue_strand_pop(workqueue_strand_t *s, workqueue_strand_item_t *item)
+{
+    workqueue_strand_item_t *head = s->head, *next;
+
+    /* 'pending' says there is an item, but its producer may not have
+       linked it in yet. */
+    while ((next = wq_atomic_load(&head->next)) == NULL) {
+        sched_yield();
+    }
+    item->func = next->func;
+    item->arg = next->arg;
+    s->head = next;
+    if (head != &s->stub) {
+        free(head);
+    }
+}
+
+static void workqueue_strand_run(int id, void *arg);
+
+/* 'reset' is false when the submitter runs the strand itself: its own
+   scratch memory must survive. */
+static void
+workqueue_strand_drain(workqueue_strand_t *s, int id, bool reset)
+{
+    unsigned int n = 0;
+
+    while (1) {
+        workqueue_strand_item_t item;
+
+        workqueue_strand_pop(s, &item);
+        item.func(id, item.arg);
+        if (reset) {
+            workqueue_scratch_done();
+        }
+
+        if (wq_atomic_sub_fetch(&s->pending, 1) == 0) {
+            return;
+        }
+        if (++n == WORKQUEUE_STRAND_BATCH) {
+            /* let other work in; whoever runs this next owns the strand. */
+            if (workqueue_submit(s->wq, workqueue_strand_run, s) == 0) {
+                return;
+            }
+            n = 0;
+        }
+    }
+}
+
+static void
+workqueue_strand_run(int id, void *arg)
+{
+    workqueue_strand_drain((workqueue_strand_t *)arg, id, true);
+}
+
+int
+workqueue_strand_submit(workqueue_strand_t *s,
+                        void (* func)(int, void *), void *arg)
+{
+    workqueue_strand_item_t *item, *prev;
+
+    if (s == NULL || func == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    item = malloc(sizeof(*item));
+    if (item == NULL) {
+        return -1;
+    }
+    item->next = NULL;
+    item->func = func;
+    item->arg = arg;
+
+    prev = wq_atomic_exchange(&s->tail, item);
+    wq_atomic_store(&prev->next, item);
+
+    if (wq_atomic_fetch_add(&s->pending, 1) == 0) {
+        if (workqueue_submit(s->wq, workqueue_strand_run, s) < 0) {
+            /* the item is already queued and we own the strand, so the
+               only way to honour it is to run the strand here. */
+            workqueue_strand_drain(s, 0, false);
+        }
+    }
+    return 0;
+}
@@ -27,30 +27,25 @@
 
 #include <pthread.h>
 
-#include "pipe.h"
+#include "worker.h"
+#include "counters.h"
+#include "attr.h"
 
 typedef struct workqueue_thread_private {
+    workqueue_counters_t c;
     pthread_mutex_t mutex;
     pthread_cond_t work_cond;
     pthread_cond_t completion_cond;
     pthread_cond_t shutdown_cond;
-    workqueue_stat_t st;
     int n;
 } workqueue_thread_private_t;
 
-static bool
+extern const workqueue_backend_t workqueue_thread_backend;
+
+static inline bool
 _workqueue_thread_locked(workqueue_thread_private_t *private)
 {
-    int rc;
-
-    rc = pthread_mutex_trylock(&private->mutex);
-    if (rc == EBUSY) {
-        return true;
-    } else if (rc != 0) {
-        return false;
-    }
-    pthread_mutex_unlock(&private->mutex);
-    return false;
+    return workqueue_counters_owned(&private->c);
 }
 
 static int
@@ -58,27 +53,26 @@ workqueue_thread_init(workqueue_t *wq)
 {
     workqueue_thread_private_t *private;
 
-    private = malloc(sizeof(workqueue_thread_private_t));
+    private = wq_aligned_alloc(sizeof(workqueue_thread_private_t));
     if (private == NULL) {
         return -1;
     }
     memset(private, 0, sizeof(workqueue_thread_private_t));
-    private->st.shutdown = false;
 
     pthread_mutex_init(&private->mutex, NULL);
     pthread_cond_init(&private->work_cond, NULL);
     pthread_cond_init(&private->completion_cond, NULL);
     pthread_cond_init(&private->shutdown_cond, NULL);
 
-    wq->private = private;
+    wq->priv = private;
     return 0;
 }
 
 static void
 workqueue_thread_destroy(workqueue_t *wq)
 {
-    if (wq->private) {
-        free(wq->private);
+    if (wq->priv) {
+        wq_aligned_free(wq->priv);
     }
 }
 
@@ -86,47 +80,52 @@ static void
 workqueue_thread_shutdown(workqueue_t *wq)
 {
     int rc = 0;
-    workqueue_thread_private_t *private = wq->private;
+    workqueue_thread_private_t *private = wq->priv;
     assert(_workqueue_thread_locked(private));
 
-    private->st.shutdown = true;
+    wq_atomic_store(&private->c.shutdown, true);
     pthread_cond_broadcast(&private->work_cond);
-    close_pipe(wq->pipefds[WORKQUEUE_READ_PIPE]);
 
-    while (private->st.current > 0 && rc == 0) {
+    while (wq_atomic_load(&private->c.current) > 0 && rc == 0) {
+        workqueue_counters_sleep(&private->c, NULL);
         rc = pthread_cond_wait(&private->shutdown_cond, &private->mutex);
+        workqueue_counters_wake(&private->c, NULL);
     }
 }
 
 static bool
 workqueue_thread_locked(workqueue_t *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
+    workqueue_thread_private_t *private = wq->priv;
     return _workqueue_thread_locked(private);
 }
 
 static void
 workqueue_thread_lock(workqueue_t *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    pthread_mutex_lock(&private->mutex);
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_counters_lock(&private->c, &private->mutex);
 }
 
 static void
 workqueue_thread_unlock(workqueue_t *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    assert(_workqueue_thread_locked(private));
-    pthread_mutex_unlock(&private->mutex);
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_counters_unlock(&private->c, &private->mutex);
 }
 
 static int
-_workqueue_thread_cond_wait(pthread_cond_t *cond,
-                            pthread_mutex_t *mutex,
+_workqueue_thread_cond_wait(workqueue_thread_private_t *private,
+                            pthread_cond_t *cond,
+                            unsigned int *count,
                             unsigned int timeout)
 {
+    pthread_mutex_t *mutex = &private->mutex;
     int rc = 0;
 
+    assert(_workqueue_thread_locked(private));
+    workqueue_counters_sleep(&private->c, count);
+
     if (timeout) {
         struct timeval now;
         struct timespec ts;
@@ -134,38 +133,45 @@ _workqueue_thread_cond_wait(pthread_cond_t *cond,
         ts.tv_sec = now.tv_sec + timeout;
         ts.tv_nsec = now.tv_usec * 1000;
         rc = pthread_cond_timedwait(cond, mutex, &ts);
-        if (rc == ETIMEDOUT) {
-            return rc;
-        }
     } else {
         rc = pthread_cond_wait(cond, mutex);
     }
 
+    workqueue_counters_wake(&private->c, count);
     return rc;
 }
 
 static void
 workqueue_thread_submit(struct workqueue *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    pthread_cond_signal(&private->work_cond);
+    workqueue_thread_private_t *private = wq->priv;
+    if (workqueue_counters_contended(&private->c, &private->c.sleepers)) {
+        workqueue_counters_lock(&private->c, &private->mutex);
+        pthread_cond_signal(&private->work_cond);
+        workqueue_counters_unlock(&private->c, &private->mutex);
+    }
+}
+
+static void
+workqueue_thread_enqueue(struct workqueue *wq, int n)
+{
+    workqueue_thread_private_t *private = wq->priv;
+    wq_atomic_add_fetch(&private->c.queued, n);
 }
 
 static int
 workqueue_thread_wait(struct workqueue *wq, unsigned int timeout)
 {
-    workqueue_thread_private_t *private = wq->private;
-    return _workqueue_thread_cond_wait(&private->completion_cond,
-                                       &private->mutex,
-                                       timeout);
+    workqueue_thread_private_t *private = wq->priv;
+    return _workqueue_thread_cond_wait(private, &private->completion_cond,
+                                       &private->c.waiters, timeout);
 }
 
 static int
 workqueue_thread_stat(workqueue_t *wq, workqueue_stat_t *st)
 {
-    workqueue_thread_private_t *private = wq->private;
-    assert(_workqueue_thread_locked(private));
-    *st = private->st;
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_counters_stat(&private->c, st);
     return 0;
 }
 
@@ -173,15 +179,32 @@ static int
 workqueue_thread_worker_create(struct workqueue *wq, void *(*func)(void *))
 {
     int rc;
+    unsigned int max;
     pthread_t t;
+    pthread_attr_t attr;
 
-    workqueue_thread_private_t *private = wq->private;
-    assert(_workqueue_thread_locked(private));
+    workqueue_thread_private_t *private = wq->priv;
+
+    workqueue_counters_lock(&private->c, &private->mutex);
+    max = workqueue_max_workers(wq) + wq_atomic_load(&private->c.blocked);
+    if (private->c.current >= max || private->c.shutdown) {
+        workqueue_counters_unlock(&private->c, &private->mutex);
+        return EAGAIN;
+    }
+    wq_atomic_add_fetch(&private->c.current, 1);
+    workqueue_counters_unlock(&private->c, &private->mutex);
 
-    rc = pthread_create(&t, NULL, func, wq);
+    workqueue_attr_init(&attr, wq->stack_size, wq->guard_size);
+    rc = pthread_create(&t, &attr, func, wq);
+    pthread_attr_destroy(&attr);
     if (rc == 0) {
         pthread_detach(t);
-        private->st.current++;
+    } else {
+        workqueue_counters_lock(&private->c, &private->mutex);
+        wq_atomic_sub_fetch(&private->c.current, 1);
+        pthread_cond_signal(&private->shutdown_cond);
+        pthread_cond_broadcast(&private->completion_cond);
+        workqueue_counters_unlock(&private->c, &private->mutex);
     }
     return rc;
 }
@@ -189,9 +212,9 @@ workqueue_thread_worker_create(struct workqueue *wq, void *(*func)(void *))
 static void
 workqueue_thread_worker_start(struct workqueue *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
+    workqueue_thread_private_t *private = wq->priv;
     assert(_workqueue_thread_locked(private));
-    private->st.available++;
+    wq_atomic_add_fetch(&private->c.available, 1);
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 }
 
@@ -199,43 +222,53 @@ workqueue_thread_worker_start(struct workqueue *wq)
 static int
 workqueue_thread_worker_wait(workqueue_t *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    return _workqueue_thread_cond_wait(&private->work_cond,
-                                       &private->mutex,
-                                       wq->timeout);
+    workqueue_thread_private_t *private = wq->priv;
+    return _workqueue_thread_cond_wait(private, &private->work_cond,
+                                       &private->c.sleepers, wq->timeout);
 }
 
 static void
 workqueue_thread_worker_finish(struct workqueue *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
+    workqueue_thread_private_t *private = wq->priv;
     assert(_workqueue_thread_locked(private));
-    private->st.available--;
-    private->st.current--;
+    wq_atomic_sub_fetch(&private->c.available, 1);
+    wq_atomic_sub_fetch(&private->c.current, 1);
     pthread_cond_signal(&private->shutdown_cond);
 }
 
 static void
 workqueue_thread_worker_idle(struct workqueue *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    assert(_workqueue_thread_locked(private));
-    private->st.available++;
+    workqueue_thread_private_t *private = wq->priv;
+    __atomic_add_fetch(&private->c.available, 1, __ATOMIC_SEQ_CST);
 }
 
+/* available goes down before queued so the queue never looks idle. */
 static void
 workqueue_thread_worker_busy(struct workqueue *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    assert(_workqueue_thread_locked(private));
-    private->st.available--;
+    workqueue_thread_private_t *private = wq->priv;
+    wq_atomic_sub_fetch(&private->c.available, 1);
+    wq_atomic_sub_fetch(&private->c.queued, 1);
 }
 
 static void
 workqueue_thread_worker_complete(struct workqueue *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    pthread_cond_broadcast(&private->completion_cond);
+    workqueue_thread_private_t *private = wq->priv;
+    if (workqueue_counters_contended(&private->c, &private->c.waiters)) {
+        workqueue_counters_lock(&private->c, &private->mutex);
+        pthread_cond_broadcast(&private->completion_cond);
+        workqueue_counters_unlock(&private->c, &private->mutex);
+    }
+}
+
+static void
+workqueue_thread_blocking(struct workqueue *wq, int n)
+{
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_counters_blocking(&private->c, n);
 }
 
 static int
@@ -244,9 +277,18 @@ workqueue_thread_self(workqueue_t *wq)
     return (int)GetCurrentThreadId();
 }
 
-workqueue_backend_t
+/* The worker loop specialized for this backend. */
+static void *
+workqueue_thread_worker(void *arg)
+{
+    return workqueue_worker_main((workqueue_t *)arg,
+                                 &workqueue_thread_backend);
+}
+
+const workqueue_backend_t
 workqueue_thread_backend = {
     .name = "thread",
+    .flags = WORKQUEUE_BACKEND_SHARED_MEMORY,
     .init = workqueue_thread_init,
     .shutdown = workqueue_thread_shutdown,
     .destroy = workqueue_thread_destroy,
@@ -254,6 +296,7 @@ workqueue_thread_backend = {
     .unlock = workqueue_thread_unlock,
     .locked = workqueue_thread_locked,
     .submit = workqueue_thread_submit,
+    .enqueue = workqueue_thread_enqueue,
     .wait = workqueue_thread_wait,
     .stat = workqueue_thread_stat,
 
@@ -266,4 +309,6 @@ workqueue_thread_backend = {
     .worker_finish = workqueue_thread_worker_finish,
 
     .self = workqueue_thread_self,
+    .blocking = workqueue_thread_blocking,
+    .worker = workqueue_thread_worker,
 };
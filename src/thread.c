@@ -25,31 +25,92 @@
 #include <unistd.h>
 #include <wq.h>
 
+#include "worker.h"
+#include "counters.h"
+#include "manager.h"
+#include "attr.h"
+#include "fiber.h"
+
+/* A worker parked in workqueue_thread_worker_wait(), on its own stack.
+   Parked workers form a stack and submit wakes the top one: the most
+   recently active worker gets the work while the ones at the bottom
+   stay asleep long enough to time out and exit. */
+typedef struct workqueue_thread_sleeper {
+    pthread_cond_t cond;
+    struct workqueue_thread_sleeper *next, *prev;
+    bool woken;
+    /* an item handed over by workqueue_thread_handoff(). */
+    bool full;
+    work_item_t item;
+} workqueue_thread_sleeper_t;
+
+/* where a woken worker keeps its handed over item until getitem()
+   picks it up, see workqueue_thread_worker_handoff(). */
+static __thread bool workqueue_thread_mailbox_full;
+static __thread work_item_t workqueue_thread_mailbox;
+
+#define WORKQUEUE_SLOT_EMPTY 0
+#define WORKQUEUE_SLOT_FULL 1
+#define WORKQUEUE_SLOT_BUSY 2
+
+/* One item submitted by a worker from inside a running item.  The
+   worker runs it next, before looking at the pipe, unless an idle
+   worker steals it first.  Only the owner fills the slot (EMPTY ->
+   FULL); whoever takes it, owner or thief, goes FULL -> BUSY -> EMPTY,
+   so neither side needs the lock. */
+typedef struct workqueue_thread_local {
+    int state;
+    work_item_t item;
+    /* on the private->locals list, protected by the mutex. */
+    struct workqueue_thread_local *next, *prev;
+    struct workqueue_thread_private *private;
+    /* the lowest slot number free when the worker started, see
+       workqueue_thread_push_worker(). */
+    unsigned int slot;
+    /* items for this worker only, protected by the mutex; 'pending' is
+       also read without it. */
+    work_item_t *inbox;
+    unsigned int inbox_head;
+    unsigned int inbox_size;
+    unsigned int pending;
+    /* roughly when the oldest item in the inbox was queued. */
+    struct timespec since;
+    /* while parked, protected by the mutex. */
+    workqueue_thread_sleeper_t *parked;
+} workqueue_thread_local_t;
+
+static __thread workqueue_thread_local_t *workqueue_thread_local;
+
 typedef struct workqueue_thread_private {
+    workqueue_counters_t c;
     pthread_mutex_t mutex;
-    pthread_cond_t work_cond;
+    /* top of the parked worker stack, protected by mutex. */
+    workqueue_thread_sleeper_t *idle;
+    /* every running worker's slot, protected by mutex. */
+    workqueue_thread_local_t *locals;
+    /* fibers ready to continue, protected by mutex (fiber backend). */
+    struct workqueue_fiber *ready;
+    struct workqueue_fiber **ready_tail;
     pthread_cond_t completion_cond;
     pthread_cond_t shutdown_cond;
     pthread_key_t key;
-    workqueue_stat_t st;
     int n;
 } workqueue_thread_private_t;
 
+extern const workqueue_backend_t workqueue_thread_backend;
+extern const workqueue_backend_t workqueue_fiber_backend;
+
 extern int wq_gettime(struct timespec *tp);
+extern int wq_monotime(struct timespec *tp);
 
-static bool
+/* how long an item waits in a busy worker's inbox before an idle worker
+   may take it, see workqueue_thread_push_worker(). */
+#define WORKQUEUE_THREAD_STEAL_DELAY 1000000L   /* nsecs */
+
+static inline bool
 _workqueue_thread_locked(workqueue_thread_private_t *private)
 {
-    int rc;
-
-    rc = pthread_mutex_trylock(&private->mutex);
-    if (rc == EBUSY) {
-        return true;
-    } else if (rc != 0) {
-        return false;
-    }
-    pthread_mutex_unlock(&private->mutex);
-    return false;
+    return workqueue_counters_owned(&private->c);
 }
 
 static int
@@ -58,120 +119,263 @@ workqueue_thread_init(workqueue_t *wq)
     workqueue_thread_private_t *private;
     int rc;
 
-    private = malloc(sizeof(workqueue_thread_private_t));
+    private = wq_aligned_alloc(sizeof(workqueue_thread_private_t));
     if (private == NULL) {
         return -1;
     }
     memset(private, 0, sizeof(workqueue_thread_private_t));
-    private->st.shutdown = false;
 
     pthread_mutex_init(&private->mutex, NULL);
-    pthread_cond_init(&private->work_cond, NULL);
+    private->ready_tail = &private->ready;
     pthread_cond_init(&private->completion_cond, NULL);
     pthread_cond_init(&private->shutdown_cond, NULL);
 
     rc = pthread_key_create(&private->key, NULL);
     if (rc < 0) {
-        free(private);
+        wq_aligned_free(private);
         return -1;
     }
 
-    wq->private = private;
+    wq->priv = private;
     return 0;
 }
 
 static void
 workqueue_thread_destroy(workqueue_t *wq)
 {
-    if (wq->private) {
-        workqueue_thread_private_t *private = wq->private;
+    if (wq->priv) {
+        workqueue_thread_private_t *private = wq->priv;
         pthread_key_delete(private->key);
-        free(wq->private);
+        wq_aligned_free(wq->priv);
+    }
+}
+
+static void
+_workqueue_thread_push_idle(workqueue_thread_private_t *private,
+                            workqueue_thread_sleeper_t *s)
+{
+    s->prev = NULL;
+    s->next = private->idle;
+    if (s->next != NULL) {
+        s->next->prev = s;
     }
+    private->idle = s;
+}
+
+static void
+_workqueue_thread_remove_idle(workqueue_thread_private_t *private,
+                              workqueue_thread_sleeper_t *s)
+{
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        private->idle = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+}
+
+/* Wake the most recently parked worker, if any, optionally handing it
+   'item'. */
+static bool
+_workqueue_thread_wake_idle(workqueue_thread_private_t *private,
+                            const work_item_t *item)
+{
+    workqueue_thread_sleeper_t *s = private->idle;
+
+    assert(_workqueue_thread_locked(private));
+    if (s == NULL) {
+        return false;
+    }
+    _workqueue_thread_remove_idle(private, s);
+    if (item != NULL) {
+        s->item = *item;
+        s->full = true;
+    }
+    s->woken = true;
+    pthread_cond_signal(&s->cond);
+    return true;
 }
 
 static void
 workqueue_thread_shutdown(workqueue_t *wq)
 {
     int rc = 0;
-    workqueue_thread_private_t *private = wq->private;
+    workqueue_thread_private_t *private = wq->priv;
     assert(_workqueue_thread_locked(private));
 
-    private->st.shutdown = true;
-    pthread_cond_broadcast(&private->work_cond);
-    close(wq->pipefds[WORKQUEUE_READ_PIPE]);
+    wq_atomic_store(&private->c.shutdown, true);
+    while (_workqueue_thread_wake_idle(private, NULL)) {
+    }
 
-    while (private->st.current > 0 && rc == 0) {
+    while (wq_atomic_load(&private->c.current) > 0 && rc == 0) {
+        workqueue_counters_sleep(&private->c, NULL);
         rc = pthread_cond_wait(&private->shutdown_cond, &private->mutex);
+        workqueue_counters_wake(&private->c, NULL);
     }
 }
 
 static bool
 workqueue_thread_locked(workqueue_t *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
+    workqueue_thread_private_t *private = wq->priv;
     return _workqueue_thread_locked(private);
 }
 
 static void
 workqueue_thread_lock(workqueue_t *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    pthread_mutex_lock(&private->mutex);
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_counters_lock(&private->c, &private->mutex);
 }
 
 static void
 workqueue_thread_unlock(workqueue_t *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    assert(_workqueue_thread_locked(private));
-    pthread_mutex_unlock(&private->mutex);
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_counters_unlock(&private->c, &private->mutex);
 }
 
 static int
-_workqueue_thread_cond_wait(pthread_cond_t *cond,
-                            pthread_mutex_t *mutex,
+_workqueue_thread_cond_wait(workqueue_thread_private_t *private,
+                            pthread_cond_t *cond,
+                            unsigned int *count,
                             unsigned int timeout)
 {
+    pthread_mutex_t *mutex = &private->mutex;
     int rc = 0;
 
+    assert(_workqueue_thread_locked(private));
+    workqueue_counters_sleep(&private->c, count);
+
     if (timeout) {
         struct timespec ts;
         wq_gettime(&ts);
         ts.tv_sec += timeout;
         rc = pthread_cond_timedwait(cond, mutex, &ts);
-        if (rc == ETIMEDOUT) {
-            return rc;
-        }
     } else {
         rc = pthread_cond_wait(cond, mutex);
     }
 
+    workqueue_counters_wake(&private->c, count);
     return rc;
 }
 
 static void
 workqueue_thread_submit(struct workqueue *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    pthread_cond_signal(&private->work_cond);
+    workqueue_thread_private_t *private = wq->priv;
+    if (workqueue_counters_contended(&private->c, &private->c.sleepers)) {
+        workqueue_counters_lock(&private->c, &private->mutex);
+        _workqueue_thread_wake_idle(private, NULL);
+        workqueue_counters_unlock(&private->c, &private->mutex);
+    }
+}
+
+static bool
+_workqueue_thread_slot_take(workqueue_thread_local_t *local,
+                            work_item_t *item)
+{
+    int expected = WORKQUEUE_SLOT_FULL;
+
+    if (wq_atomic_load_relaxed(&local->state) != WORKQUEUE_SLOT_FULL ||
+        !wq_atomic_cas(&local->state, &expected, WORKQUEUE_SLOT_BUSY)) {
+        return false;
+    }
+    *item = local->item;
+    wq_atomic_store(&local->state, WORKQUEUE_SLOT_EMPTY);
+    return true;
+}
+
+/* A submit from one of our own workers goes to its slot.  Parked
+   workers are woken as usual, so one of them can steal the item while
+   the submitter is still busy; that only takes the lock when there is
+   a sleeper (see counters.h), not on a busy queue. */
+static int
+_workqueue_thread_slot_put(workqueue_t *wq, const work_item_t *item)
+{
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_thread_local_t *local = workqueue_thread_local;
+    workqueue_stat_t st;
+
+    if (local == NULL || local->private != private ||
+        wq_atomic_load_relaxed(&local->state) != WORKQUEUE_SLOT_EMPTY) {
+        return EAGAIN;
+    }
+
+    workqueue_counters_stat(&private->c, &st);
+    wq_atomic_add_fetch(&private->c.queued, 1);
+    local->item = *item;
+    wq_atomic_store(&local->state, WORKQUEUE_SLOT_FULL);
+
+    if (workqueue_counters_contended(&private->c, &private->c.sleepers)) {
+        bool woken;
+
+        workqueue_counters_lock(&private->c, &private->mutex);
+        woken = _workqueue_thread_wake_idle(private, NULL);
+        workqueue_counters_unlock(&private->c, &private->mutex);
+        if (woken) {
+            return 0;
+        }
+    }
+    if (st.queued >= st.available &&
+        st.current < workqueue_max_workers(wq) + st.blocked) {
+        workqueue_manager_request(wq);
+    }
+    return 0;
+}
+
+/* With a worker parked, give it the item directly: it skips the pipe
+   and, once woken, doesn't have to look for it.  A busy queue has no
+   sleepers, so this doesn't put the lock back on the submit path. */
+static int
+workqueue_thread_handoff(struct workqueue *wq, const work_item_t *item)
+{
+    workqueue_thread_private_t *private = wq->priv;
+    bool handed;
+
+    if (_workqueue_thread_slot_put(wq, item) == 0) {
+        return 0;
+    }
+    if (wq_atomic_load(&private->c.sleepers) == 0) {
+        return EAGAIN;
+    }
+
+    workqueue_counters_lock(&private->c, &private->mutex);
+    handed = false;
+    if (!private->c.shutdown) {
+        /* worker_busy() takes it off again. */
+        wq_atomic_add_fetch(&private->c.queued, 1);
+        handed = _workqueue_thread_wake_idle(private, item);
+        if (!handed) {
+            wq_atomic_sub_fetch(&private->c.queued, 1);
+        }
+    }
+    workqueue_counters_unlock(&private->c, &private->mutex);
+    return handed ? 0 : EAGAIN;
+}
+
+static void
+workqueue_thread_enqueue(struct workqueue *wq, int n)
+{
+    workqueue_thread_private_t *private = wq->priv;
+    wq_atomic_add_fetch(&private->c.queued, n);
 }
 
 static int
 workqueue_thread_wait(struct workqueue *wq, unsigned int timeout)
 {
-    workqueue_thread_private_t *private = wq->private;
-    return _workqueue_thread_cond_wait(&private->completion_cond,
-                                       &private->mutex,
-                                       timeout);
+    workqueue_thread_private_t *private = wq->priv;
+    return _workqueue_thread_cond_wait(private, &private->completion_cond,
+                                       &private->c.waiters, timeout);
 }
 
 static int
 workqueue_thread_stat(workqueue_t *wq, workqueue_stat_t *st)
 {
-    workqueue_thread_private_t *private = wq->private;
-    assert(_workqueue_thread_locked(private));
-    *st = private->st;
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_counters_stat(&private->c, st);
     return 0;
 }
 
@@ -179,20 +383,39 @@ static int
 workqueue_thread_worker_create(struct workqueue *wq, void *(*func)(void *))
 {
     int rc;
+    unsigned int max;
     pthread_t t;
+    pthread_attr_t attr;
     sigset_t set, oldset;
 
-    workqueue_thread_private_t *private = wq->private;
-    assert(_workqueue_thread_locked(private));
+    workqueue_thread_private_t *private = wq->priv;
+
+    /* count it up front so concurrent callers respect max_workers, but
+       don't hold the lock across pthread_create(). */
+    workqueue_counters_lock(&private->c, &private->mutex);
+    max = workqueue_max_workers(wq) + wq_atomic_load(&private->c.blocked);
+    if (private->c.current >= max || private->c.shutdown) {
+        workqueue_counters_unlock(&private->c, &private->mutex);
+        return EAGAIN;
+    }
+    wq_atomic_add_fetch(&private->c.current, 1);
+    workqueue_counters_unlock(&private->c, &private->mutex);
 
     sigfillset(&set);
-    sigprocmask(SIG_BLOCK, &set, &oldset);
-    rc = pthread_create(&t, NULL, func, wq);
-    sigprocmask(SIG_SETMASK, &oldset, NULL);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    workqueue_attr_init(&attr, wq->stack_size, wq->guard_size);
+    rc = pthread_create(&t, &attr, func, wq);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    pthread_attr_destroy(&attr);
 
     if (rc == 0) {
         pthread_detach(t);
-        private->st.current++;
+    } else {
+        workqueue_counters_lock(&private->c, &private->mutex);
+        wq_atomic_sub_fetch(&private->c.current, 1);
+        pthread_cond_signal(&private->shutdown_cond);
+        pthread_cond_broadcast(&private->completion_cond);
+        workqueue_counters_unlock(&private->c, &private->mutex);
     }
     return rc;
 }
@@ -200,12 +423,34 @@ workqueue_thread_worker_create(struct workqueue *wq, void *(*func)(void *))
 static void
 workqueue_thread_worker_start(struct workqueue *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
+    workqueue_thread_private_t *private = wq->priv;
     unsigned long id;
 
     assert(_workqueue_thread_locked(private));
-    private->st.available++;
+    wq_atomic_add_fetch(&private->c.available, 1);
     id = ++private->n;
+
+    workqueue_thread_local = calloc(1, sizeof(workqueue_thread_local_t));
+    if (workqueue_thread_local != NULL) {
+        workqueue_thread_local_t *local = workqueue_thread_local, *l;
+
+        /* workers are few, a linear search will do. */
+        l = private->locals;
+        while (l != NULL) {
+            if (l->slot == local->slot) {
+                local->slot++;
+                l = private->locals;
+            } else {
+                l = l->next;
+            }
+        }
+        local->private = private;
+        local->next = private->locals;
+        if (local->next != NULL) {
+            local->next->prev = local;
+        }
+        private->locals = local;
+    }
     pthread_setspecific(private->key, (void *)id);
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 }
@@ -214,56 +459,371 @@ workqueue_thread_worker_start(struct workqueue *wq)
 static int
 workqueue_thread_worker_wait(workqueue_t *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    return _workqueue_thread_cond_wait(&private->work_cond,
-                                       &private->mutex,
-                                       wq->timeout);
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_thread_sleeper_t s;
+    struct timespec ts;
+    int rc = 0;
+
+    assert(_workqueue_thread_locked(private));
+    pthread_cond_init(&s.cond, NULL);
+    s.woken = false;
+    s.full = false;
+    _workqueue_thread_push_idle(private, &s);
+    if (workqueue_thread_local != NULL) {
+        workqueue_thread_local->parked = &s;
+    }
+
+    if (wq->timeout) {
+        wq_gettime(&ts);
+        ts.tv_sec += wq->timeout;
+    }
+
+    workqueue_counters_sleep(&private->c, &private->c.sleepers);
+    while (!s.woken && rc == 0) {
+        if (wq->timeout) {
+            rc = pthread_cond_timedwait(&s.cond, &private->mutex, &ts);
+        } else {
+            rc = pthread_cond_wait(&s.cond, &private->mutex);
+        }
+    }
+    workqueue_counters_wake(&private->c, &private->c.sleepers);
+    if (workqueue_thread_local != NULL) {
+        workqueue_thread_local->parked = NULL;
+    }
+
+    if (s.woken) {
+        rc = 0;
+        if (s.full) {
+            workqueue_thread_mailbox = s.item;
+            workqueue_thread_mailbox_full = true;
+        }
+    } else {
+        _workqueue_thread_remove_idle(private, &s);
+    }
+    pthread_cond_destroy(&s.cond);
+    return rc;
+}
+
+/* Fibers resumed by workqueue_fiber_cond_wait() wakers or yielding
+   queue up here, in order, and like items are counted in 'queued'. */
+static void
+workqueue_thread_resume(struct workqueue *wq, struct workqueue_fiber *f)
+{
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_stat_t st;
+    bool woken;
+
+    workqueue_counters_stat(&private->c, &st);
+    workqueue_counters_lock(&private->c, &private->mutex);
+    wq_atomic_add_fetch(&private->c.queued, 1);
+    *workqueue_fiber_next(f) = NULL;
+    wq_atomic_store(private->ready_tail, f);
+    private->ready_tail = workqueue_fiber_next(f);
+    woken = _workqueue_thread_wake_idle(private, NULL);
+    workqueue_counters_unlock(&private->c, &private->mutex);
+
+    if (!woken && st.queued >= st.available &&
+        st.current < workqueue_max_workers(wq) + st.blocked) {
+        workqueue_manager_request(wq);
+    }
+}
+
+static bool
+_workqueue_thread_ready_take(workqueue_thread_private_t *private,
+                             work_item_t *item)
+{
+    struct workqueue_fiber *f;
+    bool locked;
+
+    if (wq_atomic_load_relaxed(&private->ready) == NULL) {
+        return false;
+    }
+    locked = _workqueue_thread_locked(private);
+    if (!locked) {
+        workqueue_counters_lock(&private->c, &private->mutex);
+    }
+    f = private->ready;
+    if (f != NULL) {
+        wq_atomic_store(&private->ready, *workqueue_fiber_next(f));
+        if (private->ready == NULL) {
+            private->ready_tail = &private->ready;
+        }
+    }
+    if (!locked) {
+        workqueue_counters_unlock(&private->c, &private->mutex);
+    }
+    if (f == NULL) {
+        return false;
+    }
+    item->func = workqueue_fiber_resume;
+    item->arg = f;
+    item->size = 0;
+    return true;
+}
+
+static bool
+_workqueue_thread_inbox_take(workqueue_thread_private_t *private,
+                             workqueue_thread_local_t *local,
+                             work_item_t *item)
+{
+    bool locked, taken = false;
+
+    if (wq_atomic_load_relaxed(&local->pending) == 0) {
+        return false;
+    }
+    locked = _workqueue_thread_locked(private);
+    if (!locked) {
+        workqueue_counters_lock(&private->c, &private->mutex);
+    }
+    if (local->pending > 0) {
+        *item = local->inbox[local->inbox_head];
+        local->inbox_head = (local->inbox_head + 1) % local->inbox_size;
+        wq_atomic_store(&local->pending, local->pending - 1);
+        if (local->pending > 0) {
+            wq_monotime(&local->since);
+        }
+        taken = true;
+    }
+    if (!locked) {
+        workqueue_counters_unlock(&private->c, &private->mutex);
+    }
+    return taken;
+}
+
+/* Queues 'item' in the inbox of the worker in slot 'n', waking it if it
+   is parked.  Only that worker takes it, unless it stays busy for
+   WORKQUEUE_THREAD_STEAL_DELAY and another one is about to sleep: a
+   busy owner delays the item, it doesn't hold it up for good. */
+static int
+workqueue_thread_push_worker(struct workqueue *wq, unsigned int n,
+                             const work_item_t *item)
+{
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_thread_local_t *local;
+    workqueue_thread_sleeper_t *s;
+
+    workqueue_counters_lock(&private->c, &private->mutex);
+    for (local = private->locals; local != NULL; local = local->next) {
+        if (local->slot == n) {
+            break;
+        }
+    }
+    if (local == NULL || private->c.shutdown) {
+        workqueue_counters_unlock(&private->c, &private->mutex);
+        return EAGAIN;
+    }
+
+    if (local->pending == local->inbox_size) {
+        unsigned int size = (local->inbox_size) ? local->inbox_size * 2 : 4;
+        work_item_t *inbox = malloc(size * sizeof(*inbox));
+        unsigned int i;
+
+        if (inbox == NULL) {
+            workqueue_counters_unlock(&private->c, &private->mutex);
+            return EAGAIN;
+        }
+        for (i = 0; i < local->pending; i++) {
+            inbox[i] = local->inbox[(local->inbox_head + i) %
+                                    local->inbox_size];
+        }
+        free(local->inbox);
+        local->inbox = inbox;
+        local->inbox_head = 0;
+        local->inbox_size = size;
+    }
+    if (local->pending == 0) {
+        wq_monotime(&local->since);
+    }
+    local->inbox[(local->inbox_head + local->pending) % local->inbox_size] =
+        *item;
+    wq_atomic_store(&local->pending, local->pending + 1);
+    wq_atomic_add_fetch(&private->c.queued, 1);
+
+    /* a sleeper already woken is off the idle stack. */
+    s = local->parked;
+    if (s != NULL && !s->woken) {
+        _workqueue_thread_remove_idle(private, s);
+        s->woken = true;
+        pthread_cond_signal(&s->cond);
+    }
+    workqueue_counters_unlock(&private->c, &private->mutex);
+    return 0;
+}
+
+/* In order: an item handed over while parked, the worker's own slot
+   and inbox, a fiber ready to continue and, when about to sleep
+   (locked), any other worker's slot or long waiting inbox. */
+static bool
+workqueue_thread_worker_handoff(struct workqueue *wq, work_item_t *item)
+{
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_thread_local_t *local;
+    struct timespec now = { 0, 0 };
+
+    if (workqueue_thread_mailbox_full) {
+        *item = workqueue_thread_mailbox;
+        workqueue_thread_mailbox_full = false;
+        return true;
+    }
+    if (workqueue_thread_local != NULL &&
+        (_workqueue_thread_slot_take(workqueue_thread_local, item) ||
+         _workqueue_thread_inbox_take(private, workqueue_thread_local,
+                                      item))) {
+        return true;
+    }
+    if (_workqueue_thread_ready_take(private, item)) {
+        return true;
+    }
+    if (!_workqueue_thread_locked(private)) {
+        return false;
+    }
+    for (local = private->locals; local != NULL; local = local->next) {
+        if (_workqueue_thread_slot_take(local, item)) {
+            return true;
+        }
+        if (local == workqueue_thread_local || local->pending == 0) {
+            continue;
+        }
+        if (now.tv_sec == 0) {
+            wq_monotime(&now);
+        }
+        if ((now.tv_sec - local->since.tv_sec) * 1000000000L +
+            (now.tv_nsec - local->since.tv_nsec) >=
+            WORKQUEUE_THREAD_STEAL_DELAY &&
+            _workqueue_thread_inbox_take(private, local, item)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 static void
 workqueue_thread_worker_finish(struct workqueue *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_thread_local_t *local = workqueue_thread_local;
+
     assert(_workqueue_thread_locked(private));
-    private->st.available--;
-    private->st.current--;
+    if (local != NULL) {
+        work_item_t item;
+
+        /* only left over on shutdown, where queued items are dropped. */
+        if (_workqueue_thread_slot_take(local, &item)) {
+            wq_atomic_sub_fetch(&private->c.queued, 1);
+        }
+        wq_atomic_sub_fetch(&private->c.queued, local->pending);
+        free(local->inbox);
+        if (local->prev != NULL) {
+            local->prev->next = local->next;
+        } else {
+            private->locals = local->next;
+        }
+        if (local->next != NULL) {
+            local->next->prev = local->prev;
+        }
+        free(local);
+        workqueue_thread_local = NULL;
+    }
+    wq_atomic_sub_fetch(&private->c.available, 1);
+    wq_atomic_sub_fetch(&private->c.current, 1);
     pthread_cond_signal(&private->shutdown_cond);
 }
 
 static void
 workqueue_thread_worker_idle(struct workqueue *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    assert(_workqueue_thread_locked(private));
-    private->st.available++;
+    workqueue_thread_private_t *private = wq->priv;
+    __atomic_add_fetch(&private->c.available, 1, __ATOMIC_SEQ_CST);
 }
 
+/* available goes down before queued so the queue never looks idle. */
 static void
 workqueue_thread_worker_busy(struct workqueue *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    assert(_workqueue_thread_locked(private));
-    private->st.available--;
+    workqueue_thread_private_t *private = wq->priv;
+    wq_atomic_sub_fetch(&private->c.available, 1);
+    wq_atomic_sub_fetch(&private->c.queued, 1);
 }
 
 static void
 workqueue_thread_worker_complete(struct workqueue *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
-    pthread_cond_broadcast(&private->completion_cond);
+    workqueue_thread_private_t *private = wq->priv;
+    if (workqueue_counters_contended(&private->c, &private->c.waiters)) {
+        workqueue_counters_lock(&private->c, &private->mutex);
+        pthread_cond_broadcast(&private->completion_cond);
+        workqueue_counters_unlock(&private->c, &private->mutex);
+    }
+}
+
+static void
+workqueue_thread_blocking(struct workqueue *wq, int n)
+{
+    workqueue_thread_private_t *private = wq->priv;
+    workqueue_counters_blocking(&private->c, n);
 }
 
 static int
 workqueue_thread_self(workqueue_t *wq)
 {
-    workqueue_thread_private_t *private = wq->private;
+    workqueue_thread_private_t *private = wq->priv;
     unsigned long id = (unsigned long)pthread_getspecific(private->key);
     return (int)id;
 }
 
-workqueue_backend_t
+/* The worker loop specialized for this backend. */
+static void *
+workqueue_thread_worker(void *arg)
+{
+    return workqueue_worker_main((workqueue_t *)arg,
+                                 &workqueue_thread_backend);
+}
+
+/* The same, running the items on fibers, see fiber.c. */
+static void *
+workqueue_fiber_worker(void *arg)
+{
+    void *rc = workqueue_worker_main((workqueue_t *)arg,
+                                     &workqueue_fiber_backend);
+    workqueue_fiber_worker_exit();
+    return rc;
+}
+
+const workqueue_backend_t
 workqueue_thread_backend = {
     .name = "thread",
+    .flags = WORKQUEUE_BACKEND_SHARED_MEMORY,
+    .init = workqueue_thread_init,
+    .shutdown = workqueue_thread_shutdown,
+    .destroy = workqueue_thread_destroy,
+    .lock = workqueue_thread_lock,
+    .unlock = workqueue_thread_unlock,
+    .locked = workqueue_thread_locked,
+    .submit = workqueue_thread_submit,
+    .enqueue = workqueue_thread_enqueue,
+    .wait = workqueue_thread_wait,
+    .stat = workqueue_thread_stat,
+
+    .worker_create = workqueue_thread_worker_create,
+    .worker_start = workqueue_thread_worker_start,
+    .worker_wait = workqueue_thread_worker_wait,
+    .worker_idle = workqueue_thread_worker_idle,
+    .worker_busy = workqueue_thread_worker_busy,
+    .worker_complete = workqueue_thread_worker_complete,
+    .worker_finish = workqueue_thread_worker_finish,
+
+    .self = workqueue_thread_self,
+    .blocking = workqueue_thread_blocking,
+    .worker = workqueue_thread_worker,
+    .handoff = workqueue_thread_handoff,
+    .worker_handoff = workqueue_thread_worker_handoff,
+    .push_worker = workqueue_thread_push_worker,
+};
+
+const workqueue_backend_t
+workqueue_fiber_backend = {
+    .name = "fiber",
+    .flags = WORKQUEUE_BACKEND_SHARED_MEMORY,
     .init = workqueue_thread_init,
     .shutdown = workqueue_thread_shutdown,
     .destroy = workqueue_thread_destroy,
@@ -271,6 +831,7 @@ workqueue_thread_backend = {
     .unlock = workqueue_thread_unlock,
     .locked = workqueue_thread_locked,
     .submit = workqueue_thread_submit,
+    .enqueue = workqueue_thread_enqueue,
     .wait = workqueue_thread_wait,
     .stat = workqueue_thread_stat,
 
@@ -283,4 +844,11 @@ workqueue_thread_backend = {
     .worker_finish = workqueue_thread_worker_finish,
 
     .self = workqueue_thread_self,
+    .blocking = workqueue_thread_blocking,
+    .run = workqueue_fiber_run,
+    .resume = workqueue_thread_resume,
+    .worker = workqueue_fiber_worker,
+    .handoff = workqueue_thread_handoff,
+    .worker_handoff = workqueue_thread_worker_handoff,
+    .push_worker = workqueue_thread_push_worker,
 };
@@ -32,6 +32,7 @@
 #include <stdio.h>
 
 static clock_serv_t cclock = 0;
+static clock_serv_t sclock = 0;
 
 int
 wq_gettime(struct timespec *tp)
@@ -58,6 +59,31 @@ wq_gettime(struct timespec *tp)
       return 0;
 }
 
+int
+wq_monotime(struct timespec *tp)
+{
+   kern_return_t ret;
+   mach_timespec_t mach_t;
+
+      if (sclock == 0)
+      {
+          ret = host_get_clock_service(mach_host_self(), SYSTEM_CLOCK,
+                                       &sclock);
+          if (ret != KERN_SUCCESS) {
+              return -1;
+          }
+      }
+
+      ret = clock_get_time(sclock, &mach_t);
+      if (ret != KERN_SUCCESS) {
+          return -1;
+      }
+
+      tp->tv_sec = mach_t.tv_sec;
+      tp->tv_nsec = mach_t.tv_nsec;
+      return 0;
+}
+
 #else
 
 int
@@ -66,5 +92,12 @@ wq_gettime(struct timespec *tp)
     return clock_gettime(CLOCK_REALTIME, tp);
 }
 
+/* for measuring intervals, unaffected by changes to the date. */
+int
+wq_monotime(struct timespec *tp)
+{
+    return clock_gettime(CLOCK_MONOTONIC, tp);
+}
+
 #endif
 #endif
@@ -0,0 +1,54 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+extern workqueue_trace_func_t workqueue_trace_func;
+extern void *workqueue_trace_data;
+
+#define TRACE(fmt, args ...) do {                                       \
+        if (workqueue_trace_func != NULL) {                             \
+            workqueue_trace_func(workqueue_trace_data,                  \
+                                 "[%s] "fmt,                            \
+                                 __FUNCTION__,                          \
+                                 ## args);                              \
+        }                                                               \
+    } while(0)
+
+#define WERROR(fmt, args ...) do {                                       \
+        if (workqueue_trace_func != NULL) {                             \
+            workqueue_trace_func(workqueue_trace_data,                  \
+                                 "[%s] *** ERROR *** "fmt,              \
+                                 __FUNCTION__,                          \
+                                 ## args);                              \
+        }                                                               \
+    } while(0)
+
+#define WTRACE(wq, fmt, args ...) do {                                  \
+        if (workqueue_trace_func != NULL) {                             \
+            workqueue_trace_func(workqueue_trace_data,                  \
+                                 "%04d[%s] "fmt,                        \
+                                 workqueue_self(wq),                    \
+                                 __FUNCTION__,                          \
+                                 ## args);                              \
+        }                                                               \
+    } while(0)
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,380 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#ifndef __WORKER_H__
+#define __WORKER_H__
+
+/* The worker loop and the backend dispatch it uses.
+
+   Everything here takes the backend as an explicit argument.  wq.c
+   instantiates the loop with the runtime wq->backend, while each backend
+   also instantiates it with the address of its own (const) backend
+   table: the compiler then resolves and inlines every backend call in
+   the loop instead of going through function pointers. */
+
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "pipe.h"
+#include "trace.h"
+#include "scratch.h"
+#include "hooks.h"
+
+#ifndef ETIMEDOUT
+#define ETIMEDOUT 145
+#endif
+
+/* The pipe only carries func and arg.  An item with inline data goes
+   through wq->inlinefds whole and is stood for in the pipe by a record
+   with a NULL func, see workqueue_submit_item(). */
+#define WORKQUEUE_PIPE_RECORD offsetof(work_item_t, size)
+
+static inline void
+workqueue_backend_lock(const workqueue_backend_t *be, workqueue_t *wq)
+{
+    be->lock(wq);
+    WTRACE(wq, "\n");
+}
+
+static inline void
+workqueue_backend_unlock(const workqueue_backend_t *be, workqueue_t *wq)
+{
+    WTRACE(wq, "\n");
+    be->unlock(wq);
+}
+
+static inline void
+workqueue_backend_shutdown(const workqueue_backend_t *be, workqueue_t *wq)
+{
+    if (be->shutdown) {
+        be->shutdown(wq);
+    }
+}
+
+static inline void
+workqueue_backend_destroy(const workqueue_backend_t *be, workqueue_t *wq)
+{
+    if (be->destroy) {
+        be->destroy(wq);
+    }
+}
+
+static inline int
+workqueue_backend_worker_wait(const workqueue_backend_t *be, workqueue_t *wq)
+{
+    if (be->worker_wait) {
+        return be->worker_wait(wq);
+    }
+    return EINVAL;
+}
+
+static inline int
+workqueue_backend_worker_create(const workqueue_backend_t *be,
+                                workqueue_t *wq, void *(*func)(void *))
+{
+    if (be->worker_create) {
+        return be->worker_create(wq, func);
+    }
+    return EINVAL;
+}
+
+static inline void
+workqueue_backend_worker_start(const workqueue_backend_t *be,
+                               workqueue_t *wq)
+{
+    if (be->worker_start) {
+        be->worker_start(wq);
+    }
+}
+
+static inline void
+workqueue_backend_worker_busy(const workqueue_backend_t *be, workqueue_t *wq)
+{
+    if (be->worker_busy) {
+        be->worker_busy(wq);
+    }
+}
+
+static inline void
+workqueue_backend_worker_complete(const workqueue_backend_t *be,
+                                  workqueue_t *wq)
+{
+    if (be->worker_complete) {
+        be->worker_complete(wq);
+    }
+}
+
+static inline void
+workqueue_backend_worker_idle(const workqueue_backend_t *be, workqueue_t *wq)
+{
+    if (be->worker_idle) {
+        be->worker_idle(wq);
+    }
+}
+
+static inline void
+workqueue_backend_worker_finish(const workqueue_backend_t *be,
+                                workqueue_t *wq)
+{
+    if (be->worker_finish) {
+        be->worker_finish(wq);
+    }
+}
+
+static inline void
+workqueue_backend_submit(const workqueue_backend_t *be, workqueue_t *wq)
+{
+    assert(be->submit != NULL);
+    be->submit(wq);
+}
+
+static inline void
+workqueue_backend_enqueue(const workqueue_backend_t *be, workqueue_t *wq,
+                          int n)
+{
+    if (be->enqueue) {
+        be->enqueue(wq, n);
+    }
+}
+
+static inline int
+workqueue_backend_stat(const workqueue_backend_t *be, workqueue_t *wq,
+                       workqueue_stat_t *st)
+{
+    assert(be->stat != NULL);
+    return be->stat(wq, st);
+}
+
+static inline int
+workqueue_backend_handoff(const workqueue_backend_t *be, workqueue_t *wq,
+                          const work_item_t *item)
+{
+    if (be->handoff) {
+        return be->handoff(wq, item);
+    }
+    return EAGAIN;
+}
+
+static inline bool
+workqueue_backend_worker_handoff(const workqueue_backend_t *be,
+                                 workqueue_t *wq, work_item_t *item)
+{
+    if (be->worker_handoff) {
+        return be->worker_handoff(wq, item);
+    }
+    return false;
+}
+
+static inline bool
+workqueue_backend_worker_retire(const workqueue_backend_t *be,
+                                workqueue_t *wq)
+{
+    if (be->worker_retire) {
+        return be->worker_retire(wq);
+    }
+    return false;
+}
+
+static inline int
+workqueue_backend_self(const workqueue_backend_t *be, workqueue_t *wq)
+{
+    assert(be->self != NULL);
+    return be->self(wq);
+}
+
+static inline void
+workqueue_backend_run(const workqueue_backend_t *be, workqueue_t *wq,
+                      work_item_t *item)
+{
+    if (be->run) {
+        be->run(wq, item);
+    } else {
+        item->func(workqueue_backend_self(be, wq),
+                   (item->size > 0) ? item->u.data : item->arg);
+    }
+}
+
+/* Returns 0 with an item and without the lock, otherwise with the lock
+   held.  The pipe is read without the lock first: while items keep
+   coming a worker never touches the mutex.  Only when the pipe is empty
+   does it lock, look once more (so a submitter can see it, see
+   counters.h) and sleep. */
+static inline int
+workqueue_getitem(const workqueue_backend_t *be, workqueue_t *wq,
+                  work_item_t *item)
+{
+    int rc;
+    bool locked = false, timedout = false;
+    workqueue_stat_t st;
+
+    while (1) {
+        workqueue_backend_stat(be, wq, &st);
+        if (st.shutdown || workqueue_backend_worker_retire(be, wq)) {
+            rc = -1;
+            break;
+        }
+
+        if (workqueue_backend_worker_handoff(be, wq, item)) {
+            if (locked) {
+                workqueue_backend_unlock(be, wq);
+            }
+            WTRACE(wq, "handoff\n");
+            return 0;
+        }
+
+        /* over the limit once a blocking region ended, see
+           workqueue_blocking_end(); recheck with the lock so that it
+           is mostly just the surplus that exits. */
+        if (st.current > workqueue_max_workers(wq) + st.blocked) {
+            if (locked) {
+                rc = -1;
+                break;
+            }
+            workqueue_backend_lock(be, wq);
+            locked = true;
+            continue;
+        }
+
+        /* These reads are atomic as long as the records are no larger
+           than PIPE_BUF: every write and every read is of one record. */
+        rc = read_pipe(wq->pipefds[WORKQUEUE_READ_PIPE],
+                       item, WORKQUEUE_PIPE_RECORD);
+        if (rc == WORKQUEUE_PIPE_RECORD) {
+            item->size = 0;
+            /* the item went in before its record, so it is there. */
+            if (item->func == NULL &&
+                read_pipe(wq->inlinefds[WORKQUEUE_READ_PIPE], item,
+                          sizeof(work_item_t)) != sizeof(work_item_t)) {
+                WERROR("inline item missing: %s\n", strerror(errno));
+                continue;
+            }
+            if (locked) {
+                workqueue_backend_unlock(be, wq);
+            }
+            WTRACE(wq, "\n");
+            return 0;
+        }
+        if (rc == 0) {
+            WTRACE(wq, "exiting.\n");
+            rc = -1;
+            break;
+        }
+        if (rc < 0 && errno != EWOULDBLOCK) {
+            WERROR("read_pipe() failed: %s (%d)\n", strerror(errno), errno);
+            rc = errno;
+            break;
+        }
+
+        if (!locked) {
+            workqueue_backend_lock(be, wq);
+            locked = true;
+            continue;
+        }
+        if (timedout) {
+            /* the pipe was checked once more after the timeout. */
+            WTRACE(wq, "timeout.\n");
+            rc = ETIMEDOUT;
+            break;
+        }
+
+        rc = workqueue_backend_worker_wait(be, wq);
+        if (rc == ETIMEDOUT) {
+            timedout = true;
+        } else if (rc != 0) {
+            WERROR("workqueue_backend_wait() failed: %s\n", strerror(rc));
+            break;
+        }
+    }
+
+    if (!locked) {
+        workqueue_backend_lock(be, wq);
+    }
+    return rc;
+}
+
+static inline void *
+workqueue_worker_main(workqueue_t *wq, const workqueue_backend_t *be)
+{
+    workqueue_stat_t st;
+
+    workqueue_backend_lock(be, wq);
+    workqueue_backend_worker_start(be, wq);
+    workqueue_backend_unlock(be, wq);
+    /* until now this worker kept the queue from looking idle. */
+    workqueue_backend_worker_complete(be, wq);
+
+    /* self() is guaranteed to work after worker_start... */
+    WTRACE(wq, "start\n");
+
+    while (1) {
+        int rc = 0;
+
+        workqueue_hooks_start(wq);
+        while (1) {
+            work_item_t item;
+
+            rc = workqueue_getitem(be, wq, &item);
+            if (rc != 0)
+                break;
+
+            workqueue_backend_worker_busy(be, wq);
+
+            WTRACE(wq, "func()\n");
+            workqueue_backend_run(be, wq, &item);
+            workqueue_scratch_done();
+            if (workqueue_item_fdesc >= 0) {
+                close(workqueue_item_fdesc);
+                workqueue_item_fdesc = -1;
+            }
+
+            /* idle first, so woken waiters see the completed state. */
+            workqueue_backend_worker_idle(be, wq);
+            workqueue_backend_worker_complete(be, wq);
+        }
+
+        /* getitem() returned with the lock held; the stop hook runs
+           without it, so an item may have come in meanwhile. */
+        if (wq->worker_fini == NULL) {
+            workqueue_hooks_clear();
+            break;
+        }
+        workqueue_backend_unlock(be, wq);
+        workqueue_hooks_stop(wq);
+        workqueue_backend_lock(be, wq);
+
+        workqueue_backend_stat(be, wq, &st);
+        if (rc != ETIMEDOUT || st.shutdown || st.queued == 0) {
+            break;
+        }
+        workqueue_backend_unlock(be, wq);
+    }
+
+    workqueue_backend_worker_finish(be, wq);
+    workqueue_backend_stat(be, wq, &st);
+    WTRACE(wq, "worker exiting: current=%d\n", st.current);
+
+    workqueue_backend_unlock(be, wq);
+
+    return NULL;
+}
+
+#endif /* __WORKER_H__ */
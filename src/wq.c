@@ -17,12 +17,14 @@
    License along with the logr source code; if not, write to the Free
    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
    02111-1307 USA.  */
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #ifdef __WIN32
 #include <windows.h>
@@ -30,43 +32,52 @@
 
 #include "wq.h"
 #include "pipe.h"
+#include "trace.h"
+#include "worker.h"
+#include "keyed.h"
+#include "manager.h"
+#include "counters.h"
+#include "cpus.h"
+#include "hooks.h"
+#include "fiber.h"
 
-#ifndef ETIMEDOUT
-#define ETIMEDOUT 145
+static const workqueue_backend_t *workqueue_backends[];
+
+workqueue_trace_func_t workqueue_trace_func;
+void *workqueue_trace_data;
+
+__thread void *workqueue_worker_ctx;
+__thread int workqueue_item_fdesc = -1;
+__thread unsigned long long workqueue_thread_token;
+static unsigned int workqueue_token_seq;
+
+#ifndef __WIN32
+static pthread_once_t workqueue_token_once = PTHREAD_ONCE_INIT;
+
+/* the forking thread's token was copied into the child, where it would
+   carry the parent's pid. */
+static void
+workqueue_token_atfork_child(void)
+{
+    workqueue_thread_token = 0;
+}
+
+static void
+workqueue_token_setup(void)
+{
+    pthread_atfork(NULL, NULL, workqueue_token_atfork_child);
+}
 #endif
 
-static workqueue_backend_t *workqueue_backends[];
-
-static workqueue_trace_func_t workqueue_trace_func;
-static void *workqueue_trace_data;
-
-#define TRACE(fmt, args ...) do {                                       \
-        if (workqueue_trace_func != NULL) {                             \
-            workqueue_trace_func(workqueue_trace_data,                  \
-                                 "[%s] "fmt,                            \
-                                 __FUNCTION__,                          \
-                                 ## args);                              \
-        }                                                               \
-    } while(0)
-
-#define WERROR(fmt, args ...) do {                                       \
-        if (workqueue_trace_func != NULL) {                             \
-            workqueue_trace_func(workqueue_trace_data,                  \
-                                 "[%s] *** ERROR *** "fmt,              \
-                                 __FUNCTION__,                          \
-                                 ## args);                              \
-        }                                                               \
-    } while(0)
-
-#define WTRACE(wq, fmt, args ...) do {                                  \
-        if (workqueue_trace_func != NULL) {                             \
-            workqueue_trace_func(workqueue_trace_data,                  \
-                                 "%04d[%s] "fmt,                        \
-                                 workqueue_self(wq),                    \
-                                 __FUNCTION__,                          \
-                                 ## args);                              \
-        }                                                               \
-    } while(0)
+unsigned long long
+workqueue_token_new(void)
+{
+#ifndef __WIN32
+    pthread_once(&workqueue_token_once, workqueue_token_setup);
+#endif
+    return ((unsigned long long)getpid() << 32) |
+        __atomic_add_fetch(&workqueue_token_seq, 1, __ATOMIC_RELAXED);
+}
 
 void
 workqueue_lock(workqueue_t *wq)
@@ -91,100 +102,87 @@ workqueue_locked(workqueue_t *wq)
     return wq->backend->locked(wq);
 }
 
-static inline void
-workqueue_backend_shutdown(workqueue_t *wq)
+bool
+workqueue_idle(workqueue_t *wq)
 {
-    if (wq->backend->shutdown) {
-        wq->backend->shutdown(wq);
-    }
+    workqueue_stat_t st;
+    workqueue_backend_stat(wq->backend, wq, &st);
+    return (st.available == st.current) && st.queued == 0;
 }
 
-static inline void
-workqueue_backend_destroy(workqueue_t *wq)
+void *
+workqueue_worker_context(void)
 {
-    if (wq->backend->destroy) {
-        wq->backend->destroy(wq);
-    }
+    return workqueue_worker_ctx;
 }
 
-static inline int
-workqueue_backend_worker_wait(workqueue_t *wq)
+void
+workqueue_hooks_start(workqueue_t *wq)
 {
-    if (wq->backend->worker_wait) {
-        return wq->backend->worker_wait(wq);
-    }
-    return EINVAL;
+    workqueue_worker_ctx = (wq->worker_init != NULL) ?
+        wq->worker_init(wq, wq->worker_arg) : NULL;
 }
 
-static inline int
-workqueue_backend_worker_create(workqueue_t *wq, void *(*func)(void *))
+void
+workqueue_hooks_stop(workqueue_t *wq)
 {
-    if (wq->backend->worker_create) {
-        return wq->backend->worker_create(wq, func);
+    if (wq->worker_fini != NULL) {
+        wq->worker_fini(wq, workqueue_worker_ctx, wq->worker_arg);
     }
-    return EINVAL;
+    workqueue_worker_ctx = NULL;
 }
 
-static inline void
-workqueue_backend_worker_start(workqueue_t *wq)
+unsigned int
+workqueue_max_workers(workqueue_t *wq)
 {
-    if (wq->backend->worker_start) {
-        wq->backend->worker_start(wq);
-    }
+    unsigned int n = wq_atomic_load_relaxed(&wq->max_workers);
+    return (n > 0) ? n : workqueue_cpus();
 }
 
-static inline void
-workqueue_backend_worker_busy(workqueue_t *wq)
+int
+workqueue_stat(workqueue_t *wq, workqueue_stat_t *st)
 {
-    if (wq->backend->worker_busy) {
-        wq->backend->worker_busy(wq);
-    }
-}
+    int rc;
 
-static inline void
-workqueue_backend_worker_complete(workqueue_t *wq)
-{
-    if (wq->backend->worker_complete) {
-        wq->backend->worker_complete(wq);
+    if (wq == NULL || st == NULL) {
+        errno = EINVAL;
+        return -1;
     }
+    workqueue_cpus_update();
+    rc = workqueue_backend_stat(wq->backend, wq, st);
+    st->max_workers = workqueue_max_workers(wq);
+    return rc;
 }
 
-static inline void
-workqueue_backend_worker_idle(workqueue_t *wq)
+int
+workqueue_blocking_begin(workqueue_t *wq)
 {
-    if (wq->backend->worker_idle) {
-        wq->backend->worker_idle(wq);
-    }
-}
+    workqueue_stat_t st;
 
-static inline void
-workqueue_backend_worker_finish(workqueue_t *wq)
-{
-    if (wq->backend->worker_finish) {
-        wq->backend->worker_finish(wq);
+    if (wq == NULL || wq->backend->blocking == NULL) {
+        errno = EINVAL;
+        return -1;
     }
-}
-
-static inline void
-workqueue_backend_submit(workqueue_t *wq)
-{
-    assert (wq->backend->submit != NULL);
-    wq->backend->submit(wq);
-}
+    wq->backend->blocking(wq, 1);
 
-static inline int
-workqueue_backend_stat(workqueue_t *wq, workqueue_stat_t *st)
-{
-    assert(wq->backend->stat != NULL);
-    return wq->backend->stat(wq, st);
+    /* let in a worker for the items this one can't run now. */
+    workqueue_backend_stat(wq->backend, wq, &st);
+    if (st.queued > st.available) {
+        workqueue_manager_request(wq);
+    }
+    return 0;
 }
 
-bool
-workqueue_idle(workqueue_t *wq)
+/* the surplus worker, if any, retires on its way to the next item. */
+int
+workqueue_blocking_end(workqueue_t *wq)
 {
-    workqueue_stat_t st;
-    workqueue_backend_stat(wq, &st);
-    return (st.available == st.current);
+    if (wq == NULL || wq->backend->blocking == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    wq->backend->blocking(wq, -1);
+    return 0;
 }
 
 int
@@ -207,13 +205,13 @@ workqueue_wait(workqueue_t *wq, unsigned int timeout)
     return rc;
 }
 
-static inline workqueue_backend_t *
+static inline const workqueue_backend_t *
 workqueue_find_backend(const char *name)
 {
     int i;
 
     for (i = 0; (workqueue_backends[i] != NULL); i++) {
-        workqueue_backend_t *p = workqueue_backends[i];
+        const workqueue_backend_t *p = workqueue_backends[i];
         if (strcmp(p->name, name) == 0) {
             return p;
         }
@@ -221,11 +219,42 @@ workqueue_find_backend(const char *name)
     return NULL;
 }
 
+/* Items with inline data don't fit the pipe's records, they go through
+   a second pipe.  Workers forked before it existed couldn't read it, so
+   it is only made on first use where the workers share our descriptors;
+   the others get it right away. */
+static pthread_mutex_t workqueue_inline_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+workqueue_inline_setup(workqueue_t *wq)
+{
+    int rc = 0;
+
+    if (wq_atomic_load(&wq->inline_open)) {
+        return 0;
+    }
+    pthread_mutex_lock(&workqueue_inline_mutex);
+    if (!wq->inline_open) {
+        rc = pipe(wq->inlinefds);
+        if (rc == 0 &&
+            pipe_set_nonblocking(wq->inlinefds[WORKQUEUE_READ_PIPE]) < 0) {
+            close_pipe(wq->inlinefds[WORKQUEUE_READ_PIPE]);
+            close_pipe(wq->inlinefds[WORKQUEUE_WRITE_PIPE]);
+            rc = -1;
+        }
+        if (rc == 0) {
+            wq_atomic_store(&wq->inline_open, 1);
+        }
+    }
+    pthread_mutex_unlock(&workqueue_inline_mutex);
+    return rc;
+}
+
 int
 workqueue_init(workqueue_t *wq, const char *name)
 {
     int rc;
-    workqueue_backend_t *backend = NULL;
+    const workqueue_backend_t *backend = NULL;
 
     TRACE("%s\n", name);
 
@@ -242,6 +271,22 @@ workqueue_init(workqueue_t *wq, const char *name)
         return -1;
     }
     wq->backend = backend;
+    wq->max_workers = WORKQUEUE_DEFAULT_MAX_WORKERS;
+    wq->timeout = WORKQUEUE_DEFAULT_TIMEOUT;
+
+    /* backends with their own item queue need no pipe. */
+    if (wq->backend->push != NULL) {
+        if (workqueue_manager_attach(wq) < 0) {
+            return -1;
+        }
+        if (wq->backend->init && wq->backend->init(wq) < 0) {
+            rc = errno;
+            workqueue_manager_detach(wq);
+            errno = rc;
+            return -1;
+        }
+        return 0;
+    }
 
     rc = pipe(wq->pipefds);
     if (rc < 0) {
@@ -255,12 +300,19 @@ workqueue_init(workqueue_t *wq, const char *name)
         goto error;
     }
 
-    wq->max_workers = WORKQUEUE_DEFAULT_MAX_WORKERS;
-    wq->timeout = WORKQUEUE_DEFAULT_TIMEOUT;
+    if (!(wq->backend->flags & WORKQUEUE_BACKEND_SHARED_MEMORY) &&
+        workqueue_inline_setup(wq) < 0) {
+        goto error;
+    }
+
+    if (workqueue_manager_attach(wq) < 0) {
+        goto error;
+    }
 
     if (wq->backend->init) {
         rc = wq->backend->init(wq);
         if (rc < 0) {
+            workqueue_manager_detach(wq);
             goto error;
         }
     }
@@ -270,6 +322,10 @@ error:
     rc = errno;
     close_pipe(wq->pipefds[WORKQUEUE_READ_PIPE]);
     close_pipe(wq->pipefds[WORKQUEUE_WRITE_PIPE]);
+    if (wq->inline_open) {
+        close_pipe(wq->inlinefds[WORKQUEUE_READ_PIPE]);
+        close_pipe(wq->inlinefds[WORKQUEUE_WRITE_PIPE]);
+    }
     errno = rc;
     return -1;
 }
@@ -279,136 +335,264 @@ workqueue_destroy(workqueue_t *wq)
 {
     TRACE("\n");
     workqueue_lock(wq);
-    workqueue_backend_shutdown(wq);
-    close_pipe(wq->pipefds[WORKQUEUE_WRITE_PIPE]);
-    workqueue_backend_destroy(wq);
+    workqueue_backend_shutdown(wq->backend, wq);
+    workqueue_keyed_shutdown(wq);
+    /* only now: items still running during shutdown may submit, which
+       asks the manager for workers. */
+    workqueue_manager_detach(wq);
+    /* workers read the pipe without the lock, so it stays open until
+       they are all gone. */
+    if (wq->backend->push == NULL) {
+        close_pipe(wq->pipefds[WORKQUEUE_READ_PIPE]);
+        close_pipe(wq->pipefds[WORKQUEUE_WRITE_PIPE]);
+    }
+    if (wq->inline_open) {
+        close_pipe(wq->inlinefds[WORKQUEUE_READ_PIPE]);
+        close_pipe(wq->inlinefds[WORKQUEUE_WRITE_PIPE]);
+    }
+    workqueue_backend_destroy(wq->backend, wq);
     TRACE("done\n");
     //workqueue_unlock(wq);
 }
 
-static int
-workqueue_getitem(workqueue_t *wq, work_item_t *item)
+static void *
+workqueue_worker(void *arg)
+{
+    workqueue_t *wq = (workqueue_t *)arg;
+    return workqueue_worker_main(wq, wq->backend);
+}
+
+int
+workqueue_worker_spawn(workqueue_t *wq)
 {
     int rc;
-    workqueue_stat_t st;
 
-    while (1) {
-        workqueue_backend_stat(wq, &st);
-        if (st.shutdown) {
-            return -1;
-        }
+    rc = workqueue_backend_worker_create(wq->backend, wq,
+                                         (wq->backend->worker != NULL) ?
+                                         wq->backend->worker :
+                                         workqueue_worker);
+    if (rc == 0) {
+        WTRACE(wq, "worker created\n");
+    } else if (rc != EAGAIN) {
+        WERROR("worker creation failed: %s\n", strerror(rc));
+    }
+    return rc;
+}
 
-        /* This read is atomic as long as sizeof(work_item_t) <= PIPE_BUF */
-        rc = read_pipe(wq->pipefds[WORKQUEUE_READ_PIPE],
-                       item, sizeof(work_item_t));
-        if (rc == 0) {
-            WTRACE(wq, "exiting.\n");
-            return -1;
-        }
-        if (rc < 0 && errno != EWOULDBLOCK) {
-            WERROR("read_pipe() failed: %s (%d)\n", strerror(errno), errno);
-            return errno;
-        }
-        if (rc == sizeof(work_item_t)) {
-            break;
-        }
+/* Writes an item with inline data and then its stand-in record, see
+   WORKQUEUE_PIPE_RECORD.  Retries on its own: once the item is in, the
+   record must follow it exactly once. */
+static int
+workqueue_write_inline(workqueue_t *wq, const work_item_t *item)
+{
+    static const work_item_t record;
+    int rc;
 
-        rc = workqueue_backend_worker_wait(wq);
-        if (rc == ETIMEDOUT) {
-            WTRACE(wq, "timeout.\n");
-            return rc;
-        } else if (rc != 0) {
-            WERROR("workqueue_backend_wait() failed: %s\n", strerror(rc));
-            return rc;
-        }
+    if (workqueue_inline_setup(wq) < 0) {
+        return -1;
     }
-    WTRACE(wq, "\n");
-    return 0;
+    do {
+        rc = write_pipe(wq->inlinefds[WORKQUEUE_WRITE_PIPE], item,
+                        sizeof(*item));
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        return rc;
+    }
+    do {
+        rc = write_pipe(wq->pipefds[WORKQUEUE_WRITE_PIPE], &record,
+                        WORKQUEUE_PIPE_RECORD);
+    } while (rc < 0 && errno == EINTR);
+    return rc;
 }
 
-static void *
-workqueue_worker(void *arg)
+/* 'fd' is -1 unless the backend has write_fd. */
+static int
+workqueue_submit_item(workqueue_t *wq, work_item_t *item, int fd)
 {
-    workqueue_t *wq = (workqueue_t *)arg;
+    int rc;
+    bool spawn;
     workqueue_stat_t st;
 
-    workqueue_lock(wq);
-    workqueue_backend_worker_start(wq);
-    workqueue_unlock(wq);
-
-    /* self() is guaranteed to work after worker_start... */
-    WTRACE(wq, "start\n");
+    WTRACE(wq, "func=%p arg=%p size=%u\n",
+           item->func, item->arg, (unsigned int)item->size);
 
-    while (1) {
-        int rc = 0;
-        work_item_t item;
+    if (fd < 0 && wq->backend->push != NULL) {
+        return wq->backend->push(wq, item);
+    }
+    if (fd < 0 && workqueue_backend_handoff(wq->backend, wq, item) == 0) {
+        return 0;
+    }
 
-        workqueue_lock(wq);
+    workqueue_backend_stat(wq->backend, wq, &st);
+    workqueue_backend_enqueue(wq->backend, wq, 1);
+    spawn = (st.queued >= st.available &&
+             st.current < workqueue_max_workers(wq) + st.blocked);
+
+    /* the SIGCHLD of a recycled "process" worker may interrupt a write
+       blocked on a full pipe; being atomic, it wrote nothing. */
+    do {
+        if (fd >= 0) {
+            rc = wq->backend->write_fd(wq, item, fd);
+        } else if (item->size > 0) {
+            rc = workqueue_write_inline(wq, item);
+        } else {
+            /* This write is guaranteed to be atomic. */
+            rc = write_pipe(wq->pipefds[WORKQUEUE_WRITE_PIPE], item,
+                            WORKQUEUE_PIPE_RECORD);
+        }
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        workqueue_backend_enqueue(wq->backend, wq, -1);
+        return rc;
+    }
 
-        rc = workqueue_getitem(wq, &item);
-        if (rc != 0)
-            break;
+    workqueue_backend_submit(wq->backend, wq);
 
-        workqueue_backend_worker_busy(wq);
-        workqueue_unlock(wq);
+    /* worker creation happens asynchronously, see manager.c. */
+    if (spawn) {
+        workqueue_manager_request(wq);
+    }
+    return 0;
+}
 
-        WTRACE(wq, "func()\n");
-        item.func(workqueue_self(wq), item.arg);
+int
+workqueue_submit(workqueue_t *wq, void (* func)(int, void *), void *arg)
+{
+    work_item_t item;
 
-        workqueue_lock(wq);
-        workqueue_backend_worker_complete(wq);
-        workqueue_backend_worker_idle(wq);
-        workqueue_unlock(wq);
+    if (wq == NULL || func == NULL) {
+        errno = EINVAL;
+        return -1;
     }
 
-    workqueue_backend_worker_finish(wq);
-    workqueue_backend_stat(wq, &st);
-    WTRACE(wq, "worker exiting: current=%d\n", st.current);
-
-    workqueue_unlock(wq);
+    item.func = func;
+    item.arg = arg;
+    item.size = 0;
 
-    return NULL;
+    return workqueue_submit_item(wq, &item, -1);
 }
 
 int
-workqueue_submit(workqueue_t *wq, void (* func)(int, void *), void *arg)
+workqueue_submit_inline(workqueue_t *wq, void (* func)(int, void *),
+                        const void *data, size_t size)
 {
-    int rc;
     work_item_t item;
-    workqueue_stat_t st;
 
-    if (wq == NULL || func == NULL) {
+    if (wq == NULL || func == NULL || (data == NULL && size > 0)) {
         errno = EINVAL;
         return -1;
     }
+    if (size > WORKQUEUE_INLINE_MAX) {
+        errno = E2BIG;
+        return -1;
+    }
 
+    /* The data travels with the item through a pipe, so it is also
+       valid in a 'process' worker forked before the data existed. */
     item.func = func;
-    item.arg = arg;
+    item.arg = NULL;
+    item.size = size;
+    if (size > 0) {
+        memcpy(item.u.data, data, size);
+    }
 
-    WTRACE(wq, "func=%p arg=%p\n", func, arg);
+    return workqueue_submit_item(wq, &item, -1);
+}
 
-    workqueue_lock(wq);
-    workqueue_backend_stat(wq, &st);
-    if (st.available == 0 && st.current < wq->max_workers) {
-        rc = workqueue_backend_worker_create(wq, workqueue_worker);
-        if (rc == 0) {
-            /* This is a slight fib since the worker is counted before
-               it actually starts. */
-            WTRACE(wq, "worker created: current=%d\n", st.current+1);
-        } else {
-            WERROR("worker creation failed: %s\n", strerror(rc));
-        }
+/* Where the workers share the submitter's descriptors, the item runs
+   with a duplicate of the descriptor, see workqueue_fd_run(). */
+typedef struct workqueue_fd_item {
+    void (*func)(int, void *);
+    int fd;
+    size_t size;
+    union {
+        char data[WORKQUEUE_INLINE_MAX];
+        void *align_ptr;
+        double align_double;
+        long long align_ll;
+    } u;
+} workqueue_fd_item_t;
+
+/* On a fiber the descriptor goes with the fiber, which may park and
+   continue on another worker. */
+static void
+workqueue_fd_run(int id, void *arg)
+{
+    workqueue_fd_item_t *fi = arg;
+    int *slot = workqueue_fiber_fd();
+    int saved;
+
+    if (slot == NULL) {
+        slot = &workqueue_item_fdesc;
+    }
+    saved = *slot;
+    *slot = fi->fd;
+    fi->func(id, (fi->size > 0) ? fi->u.data : NULL);
+    *slot = saved;
+    close(fi->fd);
+    free(fi);
+}
+
+int
+workqueue_submit_fd(workqueue_t *wq, void (* func)(int, void *),
+                    const void *data, size_t size, int fd)
+{
+    workqueue_fd_item_t *fi;
+    work_item_t item;
+    int rc;
+
+    if (wq == NULL || func == NULL || (data == NULL && size > 0) ||
+        fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (size > WORKQUEUE_INLINE_MAX) {
+        errno = E2BIG;
+        return -1;
     }
-    workqueue_unlock(wq);
 
-    /* This write is guaranteed to be atomic. */
-    rc = write_pipe(wq->pipefds[WORKQUEUE_WRITE_PIPE], &item, sizeof(item));
-    if (rc < 0) return rc;
+    if (wq->backend->write_fd != NULL) {
+        item.func = func;
+        item.arg = NULL;
+        item.size = size;
+        if (size > 0) {
+            memcpy(item.u.data, data, size);
+        }
+        return workqueue_submit_item(wq, &item, fd);
+    }
 
-    workqueue_backend_submit(wq);
+    fi = malloc(sizeof(*fi));
+    if (fi == NULL) {
+        return -1;
+    }
+    fi->fd = dup(fd);
+    if (fi->fd < 0) {
+        free(fi);
+        return -1;
+    }
+    fi->func = func;
+    fi->size = size;
+    if (size > 0) {
+        memcpy(fi->u.data, data, size);
+    }
+    rc = workqueue_submit(wq, workqueue_fd_run, fi);
+    if (rc != 0) {
+        rc = errno;
+        close(fi->fd);
+        free(fi);
+        errno = rc;
+        return -1;
+    }
     return 0;
 }
 
+int
+workqueue_item_fd(void)
+{
+    int *slot = workqueue_fiber_fd();
+    return (slot != NULL) ? *slot : workqueue_item_fdesc;
+}
+
 void
 workqueue_fprintf(void *arg, const char *fmt, ...)
 {
@@ -426,15 +610,23 @@ workqueue_trace(workqueue_trace_func_t func, void *data)
     workqueue_trace_data = data;
 }
 
-extern workqueue_backend_t workqueue_thread_backend;
+extern const workqueue_backend_t workqueue_thread_backend;
 #ifndef __WIN32
-extern workqueue_backend_t workqueue_process_backend;
+extern const workqueue_backend_t workqueue_process_backend;
+extern const workqueue_backend_t workqueue_fiber_backend;
+extern const workqueue_backend_t workqueue_hybrid_backend;
 #endif
+extern const workqueue_backend_t workqueue_nofd_backend;
 
-static workqueue_backend_t *workqueue_backends[] = {
+static const workqueue_backend_t *workqueue_backends[] = {
     &workqueue_thread_backend,
 #ifndef __WIN32
     &workqueue_process_backend,
+#endif
+    &workqueue_nofd_backend,
+#ifndef __WIN32
+    &workqueue_fiber_backend,
+    &workqueue_hybrid_backend,
 #endif
     NULL,
 };
@@ -28,41 +28,108 @@
 extern "C" {
 #endif
 
-#define WORKQUEUE_DEFAULT_MAX_WORKERS 32
+/* 0: as many workers as CPUs this process may use, taking the affinity
+   mask and any cgroup CPU quota into account.  Re-evaluated while the
+   program runs, see workqueue_max_workers(). */
+#define WORKQUEUE_DEFAULT_MAX_WORKERS 0
 #define WORKQUEUE_DEFAULT_TIMEOUT 10
 
+/* for workqueue_t.guard_size: no guard page at all. */
+#define WORKQUEUE_GUARD_NONE ((size_t)-1)
+
 #define WORKQUEUE_READ_PIPE 0
 #define WORKQUEUE_WRITE_PIPE 1
 
+/* Maximum number of argument bytes that can be copied into a work item
+   by workqueue_submit_inline(). */
+#define WORKQUEUE_INLINE_MAX 48
+
 struct workqueue;
+struct work_item;
+struct workqueue_fiber;
 
 typedef void (* workqueue_trace_func_t)(void *, const char *, ...);
 
 typedef struct workqueue_stat {
     unsigned int available;
     unsigned int current;
+    /* items submitted but not yet picked up by a worker. */
+    unsigned int queued;
     bool shutdown;
+    /* the limit in effect, only filled in by workqueue_stat(). */
+    unsigned int max_workers;
+    /* workers inside workqueue_blocking_begin/end(), which don't count
+       against the limit. */
+    unsigned int blocked;
 } workqueue_stat_t;
 
+/* workers run in the submitter's address space. */
+#define WORKQUEUE_BACKEND_SHARED_MEMORY 0x1
+
 typedef struct workqueue_backend {
     const char *name;
+    unsigned int flags;
     int (*init)(struct workqueue *);
     void (*shutdown)(struct workqueue *);
     void (*destroy)(struct workqueue *);
     void (*lock)(struct workqueue *);
     void (*unlock)(struct workqueue *);
+    /* true if the calling thread holds the lock. */
     bool (*locked)(struct workqueue *);
     int (*wait)(struct workqueue *, unsigned int);
+    /* wakes a worker after an item was written, called unlocked. */
     void (*submit)(struct workqueue *);
+    /* adjusts the 'queued' count; this, stat, worker_idle and
+       worker_busy don't need the lock. */
+    void (*enqueue)(struct workqueue *, int);
     int (*stat)(struct workqueue *, struct workqueue_stat *);
+    /* called without the lock held, fails with EAGAIN at max_workers. */
     int (*worker_create)(struct workqueue *, void *(*func)(void *));
     void (*worker_start)(struct workqueue *);
+    /* sleeps until an item may be available, called with the lock. */
     int (*worker_wait)(struct workqueue *);
     void (*worker_finish)(struct workqueue *);
     void (*worker_idle)(struct workqueue *);
     void (*worker_busy)(struct workqueue *);
+    /* wakes workqueue_wait() callers, called unlocked. */
     void (*worker_complete)(struct workqueue *);
     int (*self)(struct workqueue *);
+    /* optional worker entry point specialized for this backend, see
+       workqueue_worker_main() in worker.h.  */
+    void *(*worker)(void *);
+    /* optional, queues an item without going through the pipe.  Such
+       backends don't use the pipe, stat/enqueue/submit or the manager. */
+    int (*push)(struct workqueue *, const struct work_item *);
+    /* optional, hands an item straight to a worker parked in
+       worker_wait instead of writing it to the pipe; returns 0 if it
+       did.  Called unlocked, before anything else in submit. */
+    int (*handoff)(struct workqueue *, const struct work_item *);
+    /* fetches an item handed to the calling worker, called before
+       each pipe read with or without the lock. */
+    bool (*worker_handoff)(struct workqueue *, struct work_item *);
+    /* optional, the calling worker enters (1) or leaves (-1) a blocking
+       region; 'blocked' in stat follows it. */
+    void (*blocking)(struct workqueue *, int);
+    /* optional, runs an item in place of calling its func. */
+    void (*run)(struct workqueue *, struct work_item *);
+    /* with run, queues a parked fiber to continue, see fiber.h. */
+    void (*resume)(struct workqueue *, struct workqueue_fiber *);
+    /* optional, true once the calling worker should exit rather than
+       take another item; called like worker_handoff. */
+    bool (*worker_retire)(struct workqueue *);
+    /* optional, queues an item along with a copy of the descriptor for
+       workers that don't share the submitter's descriptors, see
+       workqueue_submit_fd(); called like the pipe write in submit. */
+    int (*write_fd)(struct workqueue *, const struct work_item *, int);
+    /* optional, queues an item for the worker holding slot 'n' (slots
+       are numbered from 0 among the running workers) instead of for any
+       worker; returns 0 if it did, EAGAIN if no worker has that slot.
+       Called unlocked, see keyed.c. */
+    int (*push_worker)(struct workqueue *, unsigned int,
+                       const struct work_item *);
+    /* optional, called by the manager thread each time it looks at
+       the queue, see manager.c. */
+    void (*manage)(struct workqueue *);
 } workqueue_backend_t;
 
 #ifdef __WIN32
@@ -75,24 +142,239 @@ typedef struct workqueue_backend {
 /* This struct should be considered read-only by the backend. */
 typedef struct workqueue {
     PIPE pipefds[2];
+    /* items with inline data, see workqueue_submit_item(). */
+    PIPE inlinefds[2];
+    int inline_open;
+    /* WORKQUEUE_DEFAULT_MAX_WORKERS (0) or a fixed limit. */
     unsigned int max_workers;
     unsigned int timeout;
-    workqueue_backend_t *backend;
-    void *private;
+    /* worker thread stack and guard page sizes, 0 for the system
+       defaults; like the above, set them before submitting. */
+    size_t stack_size;
+    size_t guard_size;
+    /* threads per child process of the "hybrid" backend, 0 for the
+       default (4). */
+    unsigned int process_threads;
+    /* a "process" worker exits after 'max_items' items or once its
+       resident set exceeds 'max_rss' bytes (checked every few items),
+       0 for no limit.  A standby forked ahead of time takes over its
+       place at once. */
+    unsigned int max_items;
+    size_t max_rss;
+    /* optional, called by every worker (thread or process) before its
+       first item and after its last one.  What worker_init returns is
+       the worker's context, see workqueue_worker_context(). */
+    void *(*worker_init)(struct workqueue *wq, void *arg);
+    void (*worker_fini)(struct workqueue *wq, void *ctx, void *arg);
+    void *worker_arg;
+    const workqueue_backend_t *backend;
+    void *priv;
+    /* keyed submission lanes, created on first use. */
+    void *lanes;
+    /* worker spawning state, see manager.c. */
+    void *manager;
 } workqueue_t;
 
 typedef struct work_item {
     void (*func)(int, void *);
     void *arg;
+    /* number of bytes of 'data' in use, zero if 'arg' is used instead. */
+    size_t size;
+    union {
+        char data[WORKQUEUE_INLINE_MAX];
+        void *align_ptr;
+        double align_double;
+        long long align_ll;
+    } u;
 } work_item_t;
 
 int workqueue_init(workqueue_t *wq, const char *name);
 void workqueue_destroy(workqueue_t *wq);
 int workqueue_submit(workqueue_t *wq, void (* func)(int, void *), void *arg);
+/* copies 'size' bytes of 'data' into the work item itself, func() receives
+   a pointer to the copy which is only valid for the duration of the call.
+   Fails with E2BIG if size > WORKQUEUE_INLINE_MAX. */
+int workqueue_submit_inline(workqueue_t *wq, void (* func)(int, void *),
+                            const void *data, size_t size);
+
+/* As workqueue_submit_inline(), with a file descriptor that the worker
+   running func() gets its own copy of from workqueue_item_fd(); "process"
+   workers receive it over a Unix socket.  The copy is closed once func()
+   returns, the caller keeps (and may close) 'fd'.  Workers forked
+   earlier could not pick up a socket made later, so every "process" and
+   "hybrid" queue holds that socket pair (two descriptors) from
+   workqueue_init() on, whether it ever submits a descriptor or not. */
+int workqueue_submit_fd(workqueue_t *wq, void (* func)(int, void *),
+                        const void *data, size_t size, int fd);
+/* in func(), the descriptor its item carries, -1 if none. */
+int workqueue_item_fd(void);
+
+/* Runs body(ctx, b, e) over [begin, end) in chunks of 'grain' indices
+   (grain <= 0 picks one) on the workers and the calling thread.  Returns
+   once every chunk has completed. */
+int workqueue_parallel_for(workqueue_t *wq, long begin, long end, long grain,
+                           void (* body)(void *ctx, long b, long e),
+                           void *ctx);
+/* As above, but each participant accumulates into a private 'size' byte
+   accumulator that starts as a copy of *identity (0 for a sum, 1 for a
+   product...).  The accumulators are folded into *result, which keeps
+   its initial value, with combine(ctx, result, acc) before returning. */
+int workqueue_parallel_reduce(workqueue_t *wq, long begin, long end,
+                              long grain,
+                              void (* body)(void *ctx, long b, long e,
+                                            void *acc),
+                              void (* combine)(void *ctx, void *result,
+                                               const void *acc),
+                              void *ctx, void *result,
+                              const void *identity, size_t size);
+
+/* A pool of up to 'max_workers' threads (0 follows the CPUs available,
+   like WORKQUEUE_DEFAULT_MAX_WORKERS) shared by
+   all the queues initialized on it with workqueue_init_pool().  Each
+   queue gets a share of the workers proportional to its 'weight' while
+   several queues have items.  Such queues need no file descriptors and
+   otherwise work like any other queue. */
+typedef struct workqueue_pool workqueue_pool_t;
+
+workqueue_pool_t *workqueue_pool_create(unsigned int max_workers);
+/* every queue of the pool must have been destroyed. */
+void workqueue_pool_destroy(workqueue_pool_t *pool);
+int workqueue_init_pool(workqueue_t *wq, workqueue_pool_t *pool,
+                        unsigned int weight);
+/* stack and guard page sizes for workers started from now on, see
+   workqueue_t.stack_size. */
+void workqueue_pool_set_stack(workqueue_pool_t *pool, size_t stack_size,
+                              size_t guard_size);
+
+/* Items with the same key go to the same lane, whose items run one
+   after the other.  With the "thread" and "fiber" backends each lane
+   belongs to one worker, so a key keeps running on the same thread and
+   its data stays cache-warm; a hot key may spill over to a second lane,
+   and an idle worker may take over a lane whose owner is busy.  Needs a
+   shared-memory backend. */
+int workqueue_submit_keyed(workqueue_t *wq, unsigned long long key,
+                           void (* func)(int, void *), void *arg);
+
+/* Task graphs: nodes run once all of the nodes they depend on have
+   completed successfully.  A node returning non-zero fails the graph;
+   its dependents are skipped and workqueue_graph_wait() returns the
+   first error. */
+typedef struct workqueue_graph workqueue_graph_t;
+typedef struct workqueue_node workqueue_node_t;
+
+workqueue_graph_t *workqueue_graph_create(workqueue_t *wq);
+void workqueue_graph_destroy(workqueue_graph_t *g);
+workqueue_node_t *workqueue_graph_add(workqueue_graph_t *g,
+                                      int (* func)(int, void *), void *arg);
+/* 'node' will not start before 'dep' has completed. */
+int workqueue_graph_depend(workqueue_graph_t *g, workqueue_node_t *node,
+                           workqueue_node_t *dep);
+/* starts the graph; fails with EDEADLK if it contains a cycle. */
+int workqueue_graph_run(workqueue_graph_t *g);
+/* waits for a running graph to finish, returns 0 or the first error. */
+int workqueue_graph_wait(workqueue_graph_t *g);
+
+/* A strand runs its items one at a time, in submission order, on the
+   workers of 'wq'.  It only occupies a worker while it has items, and
+   is small enough to embed in per-connection/per-key state. */
+typedef struct workqueue_strand_item {
+    struct workqueue_strand_item *next;
+    void (*func)(int, void *);
+    void *arg;
+} workqueue_strand_item_t;
+
+typedef struct workqueue_strand {
+    workqueue_t *wq;
+    workqueue_strand_item_t *head;      /* owned by the running item */
+    workqueue_strand_item_t *tail;      /* producers swap themselves in */
+    unsigned int pending;
+    workqueue_strand_item_t stub;
+} workqueue_strand_t;
+
+int workqueue_strand_init(workqueue_strand_t *s, workqueue_t *wq);
+/* the strand must be idle. */
+void workqueue_strand_destroy(workqueue_strand_t *s);
+int workqueue_strand_submit(workqueue_strand_t *s,
+                            void (* func)(int, void *), void *arg);
+bool workqueue_strand_idle(workqueue_strand_t *s);
+
+/* Named queues: processes on the same host, related or not, submit
+   to 'wq' through a ring in shared memory that the creator registers as
+   'name' (see shm_open(), so "/something").  Each item is a copy of up
+   to WORKQUEUE_INLINE_MAX bytes, passed to func() as with
+   workqueue_submit_inline().  Submitting is lock-free and doesn't
+   enter the kernel unless the queue was idle. */
+typedef struct workqueue_named workqueue_named_t;
+
+/* in the consuming process; 'slots' (0 for 1024) is rounded up to a
+   power of 2.  Fails with EEXIST if the name is taken. */
+workqueue_named_t *workqueue_named_create(workqueue_t *wq, const char *name,
+                                          unsigned int slots,
+                                          void (* func)(int, void *));
+/* removes the name and hands the items already in the ring to 'wq'. */
+void workqueue_named_destroy(workqueue_named_t *q);
+/* in a producer. */
+workqueue_named_t *workqueue_named_open(const char *name);
+void workqueue_named_close(workqueue_named_t *q);
+/* fails with EAGAIN while the ring is full. */
+int workqueue_named_submit(workqueue_named_t *q, const void *data,
+                           size_t size);
+
+/* Items that reached the creator but failed to go to 'wq' are dropped
+   and counted.  A producer that dies in the middle of a submit holds up
+   the ring for about a second, then its item is lost; if its pid has
+   already been reused by then, the ring stays stuck until that process
+   exits too.  A producer that is only stalled that long, or whose pid
+   means nothing to the creator (another pid namespace), may be taken
+   for dead: its submit then starts over in a fresh slot, uncounted,
+   but the copy it was making may still land in the old slot and garble
+   the item that uses it next. */
+typedef struct workqueue_named_stat {
+    /* in the ring, not yet handed to 'wq'. */
+    unsigned int queued;
+    unsigned int dropped;
+    unsigned int lost;
+} workqueue_named_stat_t;
+
+int workqueue_named_stat(workqueue_named_t *q, workqueue_named_stat_t *st);
+
+/* Temporary memory for the work function calling it, bump-allocated
+   from a per-worker arena (16-byte aligned).  It must not be freed and
+   is only valid until the work function returns: the arena is reset
+   after every item.  Other threads may use it too, but must call
+   workqueue_scratch_reset() themselves. */
+void *workqueue_scratch_alloc(size_t size);
+void workqueue_scratch_reset(void);
+
+/* the context worker_init returned for the calling worker, NULL
+   outside of workers. */
+void *workqueue_worker_context(void);
 
 /* can be called without the lock held, but doesn't have much meaning. */
 bool workqueue_idle(workqueue_t *wq);
-/* must be called with wq locked or returns EPERM */
+/* the worker limit currently in effect for 'wq'. */
+unsigned int workqueue_max_workers(workqueue_t *wq);
+/* a snapshot of the worker counts and limit, doesn't need the lock. */
+int workqueue_stat(workqueue_t *wq, workqueue_stat_t *st);
+
+/* Bracket a region of a work function that may block for a while (disk,
+   network, ...).  Meanwhile the worker doesn't count against the limit,
+   so another one may be started to keep the CPUs busy; once the region
+   ends, whichever worker is over the limit retires. */
+int workqueue_blocking_begin(workqueue_t *wq);
+int workqueue_blocking_end(workqueue_t *wq);
+
+/* With the "fiber" backend items run on fibers, small stacks of their
+   own (wq->stack_size, 64KiB by default, above a guard of
+   wq->guard_size, one page by default): workqueue_graph_wait() and a
+   nested workqueue_parallel_for/reduce() then park the fiber rather
+   than its worker thread, which goes on with other items.  The fiber
+   may continue on another worker, so it must not keep thread-local
+   state (or scratch memory) across such a wait.  workqueue_yield()
+   lets the other items run first; outside of a fiber it only yields
+   the CPU. */
+void workqueue_yield(void);
+/* must be called with wq locked by the caller or returns EPERM */
 int workqueue_wait(workqueue_t *wq, unsigned int timeout);
 
 void workqueue_trace(workqueue_trace_func_t func, void *data);
@@ -0,0 +1,749 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+   http://www.akirisolutions.com
+
+   wq - A general purpose work-queue library for C/C++.
+
+   The logr package is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The logr package is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the logr source code; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+#ifndef __WQ_HPP__
+#define __WQ_HPP__
+
+/* Header-only C++11 wrapper around wq.h.
+
+   wq::workqueue q;
+   q.post([buf = std::move(buf)] { ... });
+   wq::future<int> f = q.submit([] { return 42; });
+   int v = f.get();
+
+   Callables are stored directly - there is no std::function.  Small,
+   trivially copyable callables given to post() are copied into the work
+   item itself (see workqueue_submit_inline()); everything else lives in
+   a node taken from a per-thread pooled allocator.  Futures and pooled
+   nodes rely on shared memory, so use the 'thread' backend.
+
+   With C++20 coroutines, 'co_await q.schedule()' resumes the calling
+   coroutine on a worker and wq::task<T> is a lazily started coroutine
+   whose result can be co_await'ed, or collected with wq::sync_wait(). */
+
+#include <wq.h>
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#include <optional>
+#define WQ_HAVE_COROUTINES 1
+#endif
+#endif
+
+namespace wq {
+
+namespace detail {
+
+/* Size-class free lists.  Nodes are usually allocated by the submitter
+   and freed by a worker, so each thread keeps a small cache and moves
+   blocks to/from a shared list in batches. */
+struct pool_block {
+    pool_block *next;
+};
+
+static const std::size_t pool_min_size = 64;
+static const std::size_t pool_nclasses = 6;     /* 64 .. 2048 bytes */
+static const std::size_t pool_cache_max = 64;
+
+struct pool_list {
+    std::mutex mutex;
+    pool_block *head;
+    std::size_t count;
+};
+
+inline pool_list *
+pool_shared()
+{
+    /* never destroyed: detached workers may outlive static destructors. */
+    static pool_list *lists = new pool_list[pool_nclasses]();
+    return lists;
+}
+
+inline std::size_t
+pool_class(std::size_t size)
+{
+    std::size_t i, n = pool_min_size;
+    for (i = 0; i < pool_nclasses; i++, n <<= 1) {
+        if (size <= n) {
+            break;
+        }
+    }
+    return i;
+}
+
+struct pool_cache {
+    pool_block *head[pool_nclasses];
+    std::size_t count[pool_nclasses];
+
+    pool_cache() {
+        for (std::size_t i = 0; i < pool_nclasses; i++) {
+            head[i] = nullptr;
+            count[i] = 0;
+        }
+    }
+
+    /* move up to 'n' blocks of class 'i' to the shared list. */
+    void spill(std::size_t i, std::size_t n) {
+        pool_list &list = pool_shared()[i];
+        std::lock_guard<std::mutex> lock(list.mutex);
+        while (n-- > 0 && head[i] != nullptr) {
+            pool_block *b = head[i];
+            head[i] = b->next;
+            count[i]--;
+            b->next = list.head;
+            list.head = b;
+            list.count++;
+        }
+    }
+
+    /* take up to 'n' blocks of class 'i' from the shared list. */
+    void refill(std::size_t i, std::size_t n) {
+        pool_list &list = pool_shared()[i];
+        std::lock_guard<std::mutex> lock(list.mutex);
+        while (n-- > 0 && list.head != nullptr) {
+            pool_block *b = list.head;
+            list.head = b->next;
+            list.count--;
+            b->next = head[i];
+            head[i] = b;
+            count[i]++;
+        }
+    }
+
+    ~pool_cache() {
+        for (std::size_t i = 0; i < pool_nclasses; i++) {
+            spill(i, count[i]);
+        }
+    }
+};
+
+inline pool_cache &
+pool_local()
+{
+    static thread_local pool_cache cache;
+    return cache;
+}
+
+inline void *
+pool_allocate(std::size_t size)
+{
+    std::size_t i = pool_class(size);
+    if (i == pool_nclasses) {
+        return ::operator new(size);
+    }
+
+    pool_cache &cache = pool_local();
+    if (cache.head[i] == nullptr) {
+        cache.refill(i, pool_cache_max / 2);
+    }
+    if (cache.head[i] != nullptr) {
+        pool_block *b = cache.head[i];
+        cache.head[i] = b->next;
+        cache.count[i]--;
+        return b;
+    }
+    return ::operator new(pool_min_size << i);
+}
+
+inline void
+pool_deallocate(void *p, std::size_t size)
+{
+    std::size_t i = pool_class(size);
+    if (i == pool_nclasses) {
+        ::operator delete(p);
+        return;
+    }
+
+    pool_cache &cache = pool_local();
+    pool_block *b = static_cast<pool_block *>(p);
+    b->next = cache.head[i];
+    cache.head[i] = b;
+    if (++cache.count[i] > pool_cache_max) {
+        cache.spill(i, pool_cache_max / 2);
+    }
+}
+
+template <typename T>
+inline void *
+pool_new()
+{
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+                  "over-aligned callables are not supported");
+    return pool_allocate(sizeof(T));
+}
+
+/* Reference counted completion state shared by a task and its future. */
+struct state_base {
+    std::atomic<unsigned int> refs;
+    std::atomic<bool> ready;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::exception_ptr error;
+    void (*destroy)(state_base *);
+
+    explicit state_base(void (*d)(state_base *))
+        : refs(2), ready(false), destroy(d) {}
+
+    void release() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            destroy(this);
+        }
+    }
+
+    void complete() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.store(true, std::memory_order_release);
+        }
+        cond.notify_all();
+    }
+
+    void wait() {
+        if (ready.load(std::memory_order_acquire)) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!ready.load(std::memory_order_acquire)) {
+            cond.wait(lock);
+        }
+    }
+};
+
+template <typename T>
+struct state : state_base {
+    alignas(T) unsigned char storage[sizeof(T)];
+    bool has_value;
+
+    explicit state(void (*d)(state_base *)) : state_base(d), has_value(false) {}
+
+    ~state() {
+        if (has_value) {
+            value().~T();
+        }
+    }
+
+    T &value() { return *reinterpret_cast<T *>(&storage); }
+
+    template <typename F>
+    void run(F &f) {
+        new (&storage) T(f());
+        has_value = true;
+    }
+};
+
+template <>
+struct state<void> : state_base {
+    explicit state(void (*d)(state_base *)) : state_base(d) {}
+
+    template <typename F>
+    void run(F &f) { f(); }
+};
+
+template <typename F, typename T>
+struct task_node : state<T> {
+    F func;
+
+    template <typename G>
+    explicit task_node(G &&g)
+        : state<T>(&task_node::destroy), func(std::forward<G>(g)) {}
+
+    static void destroy(state_base *s) {
+        task_node *n = static_cast<task_node *>(s);
+        n->~task_node();
+        pool_deallocate(n, sizeof(task_node));
+    }
+
+    static void run(int id, void *arg) {
+        task_node *n = static_cast<task_node *>(arg);
+        try {
+            n->state<T>::run(n->func);
+        } catch (...) {
+            n->error = std::current_exception();
+        }
+        n->complete();
+        n->release();
+    }
+};
+
+template <typename F>
+struct post_node {
+    F func;
+
+    template <typename G>
+    explicit post_node(G &&g) : func(std::forward<G>(g)) {}
+
+    static void run(int id, void *arg) {
+        post_node *n = static_cast<post_node *>(arg);
+        try {
+            n->func();
+        } catch (...) {
+            /* nowhere to report it, same as std::thread. */
+            std::terminate();
+        }
+        n->~post_node();
+        pool_deallocate(n, sizeof(post_node));
+    }
+};
+
+template <typename F>
+struct post_inline {
+    static void run(int id, void *arg) {
+        F *f = static_cast<F *>(arg);
+        try {
+            (*f)();
+        } catch (...) {
+            std::terminate();
+        }
+    }
+};
+
+template <typename F>
+struct is_inline {
+    static const bool value = std::is_trivially_copyable<F>::value
+        && sizeof(F) <= WORKQUEUE_INLINE_MAX
+        && alignof(F) <= alignof(work_item_t);
+};
+
+inline void
+throw_errno(const char *what)
+{
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+} /* namespace detail */
+
+/* Handle to the result of workqueue::submit(). */
+template <typename T>
+class future {
+public:
+    future() : s_(nullptr) {}
+    future(future &&o) : s_(o.s_) { o.s_ = nullptr; }
+    future &operator=(future &&o) {
+        if (this != &o) {
+            reset();
+            s_ = o.s_;
+            o.s_ = nullptr;
+        }
+        return *this;
+    }
+    future(const future &) = delete;
+    future &operator=(const future &) = delete;
+    ~future() { reset(); }
+
+    bool valid() const { return s_ != nullptr; }
+    bool ready() const {
+        return s_->ready.load(std::memory_order_acquire);
+    }
+    void wait() const { s_->wait(); }
+
+    /* waits for the result and rethrows any exception from the task.
+       The future is no longer valid afterwards. */
+    T get() {
+        detail::state<T> *s = s_;
+        s_ = nullptr;
+        s->wait();
+        struct guard {
+            detail::state<T> *s;
+            ~guard() { s->release(); }
+        } g = { s };
+        if (s->error) {
+            std::rethrow_exception(s->error);
+        }
+        return take(s);
+    }
+
+private:
+    template <typename U>
+    static U take(detail::state<U> *s) { return std::move(s->value()); }
+    static void take(detail::state<void> *) {}
+
+    void reset() {
+        if (s_ != nullptr) {
+            s_->release();
+            s_ = nullptr;
+        }
+    }
+
+    explicit future(detail::state<T> *s) : s_(s) {}
+    friend class workqueue;
+
+    detail::state<T> *s_;
+};
+
+/* RAII owner of a workqueue_t.  Not copyable or movable since workers
+   keep a pointer to it. */
+class workqueue {
+public:
+    explicit workqueue(const char *backend = "thread") {
+        if (workqueue_init(&wq_, backend) < 0) {
+            detail::throw_errno("workqueue_init");
+        }
+    }
+
+    ~workqueue() {
+        wait();
+        workqueue_destroy(&wq_);
+    }
+
+    workqueue(const workqueue &) = delete;
+    workqueue &operator=(const workqueue &) = delete;
+
+    workqueue_t *native() { return &wq_; }
+
+#ifdef WQ_HAVE_COROUTINES
+    class schedule_awaiter {
+    public:
+        explicit schedule_awaiter(workqueue_t *wq) : wq_(wq) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        /* the handle itself is the work item argument, so resuming on
+           a worker costs no allocation. */
+        void await_suspend(std::coroutine_handle<> h) {
+            if (workqueue_submit(wq_, &resume, h.address()) < 0) {
+                detail::throw_errno("workqueue_submit");
+            }
+        }
+
+        void await_resume() const noexcept {}
+
+    private:
+        static void resume(int id, void *arg) {
+            std::coroutine_handle<>::from_address(arg).resume();
+        }
+
+        workqueue_t *wq_;
+    };
+
+    /* co_await q.schedule() continues the coroutine on a worker. */
+    schedule_awaiter schedule() { return schedule_awaiter(&wq_); }
+#endif
+
+    /* blocks until all submitted work has been run. */
+    void wait() {
+        workqueue_lock(&wq_);
+        while (!workqueue_idle(&wq_)) {
+            workqueue_wait(&wq_, 0);
+        }
+        workqueue_unlock(&wq_);
+    }
+
+    /* runs f() on a worker, discarding the result. */
+    template <typename F>
+    void post(F &&f) {
+        typedef typename std::decay<F>::type func_t;
+        post_(std::forward<F>(f),
+              std::integral_constant<bool,
+                                     detail::is_inline<func_t>::value>());
+    }
+
+    /* runs f() on a worker and returns a handle to its result. */
+    template <typename F>
+    future<decltype(std::declval<typename std::decay<F>::type &>()())>
+    submit(F &&f) {
+        typedef typename std::decay<F>::type func_t;
+        typedef decltype(std::declval<func_t &>()()) result_t;
+        typedef detail::task_node<func_t, result_t> node_t;
+
+        void *p = detail::pool_new<node_t>();
+        node_t *n;
+        try {
+            n = new (p) node_t(std::forward<F>(f));
+        } catch (...) {
+            detail::pool_deallocate(p, sizeof(node_t));
+            throw;
+        }
+        if (workqueue_submit(&wq_, &node_t::run, n) < 0) {
+            int e = errno;
+            node_t::destroy(n);
+            errno = e;
+            detail::throw_errno("workqueue_submit");
+        }
+        return future<result_t>(n);
+    }
+
+private:
+    template <typename F>
+    void post_(F &&f, std::true_type) {
+        typedef typename std::decay<F>::type func_t;
+        func_t copy(std::forward<F>(f));
+        if (workqueue_submit_inline(&wq_, &detail::post_inline<func_t>::run,
+                                    &copy, sizeof(copy)) < 0) {
+            detail::throw_errno("workqueue_submit_inline");
+        }
+    }
+
+    template <typename F>
+    void post_(F &&f, std::false_type) {
+        typedef detail::post_node<typename std::decay<F>::type> node_t;
+
+        void *p = detail::pool_new<node_t>();
+        node_t *n;
+        try {
+            n = new (p) node_t(std::forward<F>(f));
+        } catch (...) {
+            detail::pool_deallocate(p, sizeof(node_t));
+            throw;
+        }
+        if (workqueue_submit(&wq_, &node_t::run, n) < 0) {
+            int e = errno;
+            n->~node_t();
+            detail::pool_deallocate(n, sizeof(node_t));
+            errno = e;
+            detail::throw_errno("workqueue_submit");
+        }
+    }
+
+    workqueue_t wq_;
+};
+
+#ifdef WQ_HAVE_COROUTINES
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+struct promise_base {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    struct final_awaiter {
+        bool await_ready() const noexcept { return false; }
+
+        /* symmetric transfer to whoever awaited us, on this thread. */
+        template <typename P>
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<P> h) noexcept {
+            std::coroutine_handle<> c = h.promise().continuation;
+            return c ? c : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct task_promise : promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object();
+
+    template <typename U>
+    void return_value(U &&u) { value.emplace(std::forward<U>(u)); }
+
+    T result() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*value);
+    }
+};
+
+template <>
+struct task_promise<void> : promise_base {
+    task<void> get_return_object();
+
+    void return_void() {}
+
+    void result() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+inline void
+throw_empty_task()
+{
+    throw std::system_error(std::make_error_code(std::errc::invalid_argument),
+                            "wq::task is empty");
+}
+
+/* Drives a task to completion for sync_wait(). */
+struct sync_state {
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool done = false;
+};
+
+struct sync_driver {
+    struct promise_type {
+        sync_state *s = nullptr;
+
+        sync_driver get_return_object() {
+            return sync_driver{
+                std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        struct final_awaiter {
+            bool await_ready() const noexcept { return false; }
+
+            void
+            await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                sync_state *s = h.promise().s;
+                /* notify under the lock: the waiter owns 's'. */
+                std::lock_guard<std::mutex> lock(s->mutex);
+                s->done = true;
+                s->cond.notify_all();
+            }
+
+            void await_resume() const noexcept {}
+        };
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> h;
+};
+
+} /* namespace detail */
+
+/* A lazily started coroutine.  It runs when first awaited, on the
+   awaiting thread, until it co_awaits something else (typically
+   workqueue::schedule()). */
+template <typename T>
+class task {
+public:
+    typedef detail::task_promise<T> promise_type;
+
+    task() noexcept {}
+    task(task &&o) noexcept : h_(o.h_) { o.h_ = nullptr; }
+    task &operator=(task &&o) noexcept {
+        if (this != &o) {
+            if (h_) {
+                h_.destroy();
+            }
+            h_ = o.h_;
+            o.h_ = nullptr;
+        }
+        return *this;
+    }
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+    ~task() {
+        if (h_) {
+            h_.destroy();
+        }
+    }
+
+    bool valid() const noexcept { return static_cast<bool>(h_); }
+    bool done() const noexcept { return h_ && h_.done(); }
+
+    /* an empty (default constructed or moved-from) task is "ready", so
+       await_suspend() only ever sees a valid handle, and await_resume()
+       throws rather than touch a promise that isn't there. */
+    struct ready_awaiter {
+        std::coroutine_handle<promise_type> h;
+
+        bool await_ready() const noexcept { return !h || h.done(); }
+
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<> c) noexcept {
+            h.promise().continuation = c;
+            return h;
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    struct awaiter : ready_awaiter {
+        T await_resume() {
+            if (!this->h) {
+                detail::throw_empty_task();
+            }
+            return this->h.promise().result();
+        }
+    };
+
+    awaiter operator co_await() const & noexcept { return awaiter{{h_}}; }
+    awaiter operator co_await() const && noexcept { return awaiter{{h_}}; }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+
+    template <typename U>
+    friend U sync_wait(task<U> &&t);
+    friend struct detail::task_promise<T>;
+
+    static detail::sync_driver drive(ready_awaiter a) { co_await a; }
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+template <typename T>
+inline task<T>
+detail::task_promise<T>::get_return_object()
+{
+    return task<T>(std::coroutine_handle<task_promise>::from_promise(*this));
+}
+
+inline task<void>
+detail::task_promise<void>::get_return_object()
+{
+    return task<void>(std::coroutine_handle<task_promise>::from_promise(*this));
+}
+
+/* Blocks the calling (non-coroutine) thread until 't' completes. */
+template <typename T>
+T
+sync_wait(task<T> &&t)
+{
+    detail::sync_state s;
+    if (!t.h_) {
+        detail::throw_empty_task();
+    }
+    detail::sync_driver d = task<T>::drive(
+        typename task<T>::ready_awaiter{t.h_});
+    d.h.promise().s = &s;
+    d.h.resume();
+    {
+        std::unique_lock<std::mutex> lock(s.mutex);
+        while (!s.done) {
+            s.cond.wait(lock);
+        }
+    }
+    d.h.destroy();
+    return t.h_.promise().result();
+}
+
+#endif /* WQ_HAVE_COROUTINES */
+
+} /* namespace wq */
+
+#endif /* __WQ_HPP__ */